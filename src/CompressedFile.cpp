@@ -0,0 +1,265 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+
+#include "common.h"
+#include "CompressedFile.h"
+
+#define UINT_SIZE 4
+
+using namespace std;
+using boost::shared_ptr;
+
+CompressedFile::CompressedFile(shared_ptr<FileInterface> file_,
+                               const string& name, bool frame,
+                               frame_codec_t codec_, unsigned long block_size,
+                               compression_stats_t* stats_)
+  : FileInterface(name, frame),
+    file(file_),
+    codec(codec_),
+    blockSize(block_size),
+    stats(stats_),
+    originalSize(0),
+    blockStart(0) {
+}
+
+CompressedFile::~CompressedFile() {
+}
+
+bool CompressedFile::openRead() {
+  block.clear();
+  blockStart = 0;
+  return file->openRead();
+}
+
+bool CompressedFile::openWrite() {
+  block.clear();
+  originalSize = 0;
+  if (!file->openWrite()) {
+    return false;
+  }
+  if (file->fileSize() == 0) {
+    return true;
+  }
+  // appending to what a previous run left
+  file->close();
+  countOriginalSize();
+  return file->openWrite();
+}
+
+bool CompressedFile::openTruncate() {
+  block.clear();
+  originalSize = 0;
+  return file->openTruncate();
+}
+
+// Adds up the uncompressed lengths in the headers of the blocks in the
+// file, up to the first one that isn't whole
+void CompressedFile::countOriginalSize() {
+  if (!file->openRead()) {
+    return;
+  }
+  string compressed;
+  uint32_t length;
+  while (file->readNext(compressed) > 0 &&
+         compressedFrameLength((const uint8_t*)compressed.data(),
+                               compressed.size(), length)) {
+    originalSize += length;
+  }
+  file->close();
+}
+
+bool CompressedFile::isOpen() {
+  return file->isOpen();
+}
+
+void CompressedFile::close() {
+  file->close();
+}
+
+bool CompressedFile::write(const string& data) {
+  struct iovec iov;
+  iov.iov_base = (void*)data.data();
+  iov.iov_len = data.length();
+  return writev(&iov, 1);
+}
+
+bool CompressedFile::writev(const struct iovec* iov, int iovcnt) {
+  block.clear();
+  for (int i = 0; i < iovcnt; ++i) {
+    const char* data = (const char*)iov[i].iov_base;
+    unsigned long left = iov[i].iov_len;
+    while (left > 0) {
+      unsigned long count = min(left, blockSize - block.size());
+      block.append(data, count);
+      data += count;
+      left -= count;
+      if (block.size() == blockSize && !writeBlock()) {
+        return false;
+      }
+    }
+  }
+  return writeBlock();
+}
+
+// Compresses block and writes it as one frame of the wrapped file
+bool CompressedFile::writeBlock() {
+  if (block.empty()) {
+    return true;
+  }
+
+  string compressed;
+  if (!compressFrame(codec, (const uint8_t*)block.data(), block.size(),
+                     compressed)) {
+    LOG_OPER("failed to compress <%lu> bytes for <%s>",
+             (unsigned long)block.size(), filename.c_str());
+    return false;
+  }
+  string frame = file->getFrame(compressed.size());
+
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)frame.data();
+  iov[0].iov_len = frame.length();
+  iov[1].iov_base = (void*)compressed.data();
+  iov[1].iov_len = compressed.length();
+  if (!file->writev(iov, 2)) {
+    return false;
+  }
+
+  originalSize += block.size();
+  stats->original += block.size();
+  stats->compressed += frame.length() + compressed.length();
+  block.clear();
+  return true;
+}
+
+bool CompressedFile::flush() {
+  return file->flush();
+}
+
+bool CompressedFile::sync() {
+  return file->sync();
+}
+
+// before compression, see openWrite()
+unsigned long CompressedFile::fileSize() {
+  return originalSize;
+}
+
+// Decompresses blocks until there are wanted bytes that haven't been
+// returned. Returns 1 if there are, or what the wrapped file's readNext()
+// returned instead of a block.
+long CompressedFile::readBlocks(unsigned long wanted) {
+  while (block.size() - blockStart < wanted) {
+    string compressed;
+    long result = file->readNext(compressed);
+    if (result <= 0) {
+      return result;
+    }
+
+    string data;
+    if (!decompressFrame((const uint8_t*)compressed.data(),
+                         compressed.size(), data)) {
+      // the next block might be fine, but there is no telling where the
+      // frame that was cut short ends
+      LOG_OPER("WARNING: Corruption Data Loss in block of <%lu> bytes in %s",
+               (unsigned long)compressed.size(), filename.c_str());
+      return -(long)compressed.size();
+    }
+    block.erase(0, blockStart);
+    blockStart = 0;
+    block += data;
+  }
+  return 1;
+}
+
+long CompressedFile::readNext(string& _return) {
+  if (!framed) {
+    // nothing marks where messages end, return whole blocks
+    long result = readBlocks(1);
+    if (result <= 0) {
+      return result;
+    }
+    _return.assign(block, blockStart, string::npos);
+    block.clear();
+    blockStart = 0;
+    return _return.length();
+  }
+
+  long result = readBlocks(UINT_SIZE);
+  if (result <= 0) {
+    /* end of file, or the loss in the wrapped file */
+    return result;
+  }
+  long size = unserializeUInt(block.data() + blockStart);
+  if (size == 0) {
+    return 0;
+  }
+  // check if most signiifcant bit set - should never be set
+  if (size >= INT_MAX) {
+    /* Definitely corrupted. Stop reading any further */
+    long loss = -(long)(block.size() - blockStart);
+    LOG_OPER("WARNING: Corruption Data Loss %ld bytes in %s", loss,
+             filename.c_str());
+    return loss;
+  }
+
+  result = readBlocks(UINT_SIZE + size);
+  if (result <= 0) {
+    long loss = result - (long)(block.size() - blockStart);
+    LOG_OPER("WARNING: Data Loss %ld bytes in %s", loss, filename.c_str());
+    return loss;
+  }
+  _return.assign(block, blockStart + UINT_SIZE, size);
+  blockStart += UINT_SIZE + size;
+  return size;
+}
+
+void CompressedFile::deleteFile() {
+  file->deleteFile();
+}
+
+void CompressedFile::listImpl(const string& path, vector<string>& _return) {
+  file->listImpl(path, _return);
+}
+
+string CompressedFile::getFrame(unsigned data_length) {
+  if (framed) {
+    char buf[UINT_SIZE];
+    serializeUInt(data_length, buf);
+    return string(buf, UINT_SIZE);
+  } else {
+    return string();
+  }
+}
+
+void CompressedFile::setBufferSize(unsigned long size) {
+  file->setBufferSize(size);
+}
+
+void CompressedFile::setFadvise(bool fadvise) {
+  file->setFadvise(fadvise);
+}
+
+bool CompressedFile::createDirectory(string path) {
+  return file->createDirectory(path);
+}
+
+bool CompressedFile::createSymlink(string oldpath, string newpath) {
+  return file->createSymlink(oldpath, newpath);
+}
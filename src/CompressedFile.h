@@ -0,0 +1,104 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+
+#ifndef SCRIBE_COMPRESSED_FILE_H
+#define SCRIBE_COMPRESSED_FILE_H
+
+#include "common.h"
+#include "file.h"
+#include "wire_format.h"
+
+// bytes given to CompressedFiles and what they wrote for them
+struct compression_stats_t {
+  unsigned long long original;
+  unsigned long long compressed;
+
+  compression_stats_t() : original(0), compressed(0) {}
+};
+
+/*
+ * Wraps a file of any fs_type and writes what it is given as compressed
+ * blocks, for file stores with compression set.
+ *
+ * Each writev() or write() is cut into blocks of at most block_size bytes,
+ * which are compressed on their own with compressFrame() and written as
+ * frames of the wrapped file, so the length prefixes record where blocks
+ * start and a reader can skip from block to block without decompressing.
+ * A block never spans two writes, and FileStore pads chunks relative to
+ * the start of a write, so with block_size set to chunk_size every block
+ * starts on a chunk boundary. flush() and close() have nothing to add,
+ * blocks are written right away.
+ *
+ * fileSize() counts bytes before compression, so that max_size means the
+ * same with and without it. openWrite() on a file that already has blocks
+ * reads their headers to count them.
+ *
+ * readNext() decompresses the blocks and returns the frames written into
+ * them, with the same results as StdFile::readNext().
+ */
+class CompressedFile : public FileInterface {
+ public:
+  CompressedFile(boost::shared_ptr<FileInterface> file,
+                 const std::string& name, bool framed, frame_codec_t codec,
+                 unsigned long block_size, compression_stats_t* stats);
+  virtual ~CompressedFile();
+
+  bool openRead();
+  bool openWrite();
+  bool openTruncate();
+  bool isOpen();
+  void close();
+  bool write(const std::string& data);
+  bool writev(const struct iovec* iov, int iovcnt);
+  bool flush();
+  bool sync();
+  unsigned long fileSize();
+  long readNext(std::string& _return);
+  void deleteFile();
+  void listImpl(const std::string& path, std::vector<std::string>& _return);
+  std::string getFrame(unsigned data_size);
+  void setBufferSize(unsigned long size);
+  void setFadvise(bool fadvise);
+  bool createDirectory(std::string path);
+  bool createSymlink(std::string oldpath, std::string newpath);
+
+ private:
+  bool writeBlock();
+  long readBlocks(unsigned long wanted);
+  void countOriginalSize();
+
+  boost::shared_ptr<FileInterface> file;
+  frame_codec_t codec;
+  unsigned long blockSize;
+  compression_stats_t* stats;
+  // bytes before compression in the file
+  unsigned long originalSize;
+
+  // data of the block being written, or decompressed data from blockStart
+  // that readNext() hasn't returned yet
+  std::string block;
+  unsigned long blockStart;
+
+  // disallow copy, assignment, and empty construction
+  CompressedFile();
+  CompressedFile(CompressedFile& rhs);
+  CompressedFile& operator=(CompressedFile& rhs);
+};
+
+#endif // SCRIBE_COMPRESSED_FILE_H
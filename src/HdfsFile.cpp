@@ -125,10 +125,8 @@ bool HdfsFile::write(const std::string& data) {
   return retVal;
 }
 
-void HdfsFile::flush() {
-  if (hfile) {
-    hdfsFlush(fileSys, hfile);
-  }
+bool HdfsFile::flush() {
+  return !hfile || hdfsFlush(fileSys, hfile) == 0;
 }
 
 unsigned long HdfsFile::fileSize() {
@@ -21,8 +21,8 @@ class HdfsFile : public FileInterface {
   bool openTruncate();       // truncate and open for write
   bool isOpen();             // is file open?
   void close();
-  bool write(const std::string& data);
-  void flush();
+  bool write(const std::string& data);  // writev() makes one call to this
+  bool flush();
   unsigned long fileSize();
   long readNext(std::string& _return);
   void deleteFile();
@@ -74,8 +74,8 @@ class HdfsFile : public FileInterface {
   bool isOpen()   { return false; };           // is file open?
   void close()    {};
   bool write(const std::string& data) { return false; };
-  void flush()    {};
-  void sync()     {};
+  bool flush()    { return true; };
+  bool sync()     { return false; };
   unsigned long fileSize() { return 0; };
   long readNext(std::string& _return) { return false; };
   void deleteFile() {};
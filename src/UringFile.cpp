@@ -0,0 +1,289 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+
+#include "common.h"
+#include "UringFile.h"
+
+#include <fcntl.h>
+#include <limits.h>
+
+using namespace std;
+
+UringFile::UringFile(const std::string& name, bool framed)
+  : PosixFile(name, framed),
+    ringOpen(false),
+    filling(-1),
+    inFlight(0),
+    offset(0),
+    error(0),
+    failedAt(ULONG_MAX) {
+  memset(slots, 0, sizeof(slots));
+}
+
+UringFile::~UringFile() {
+  close();
+  // a slot the kernel never gave back is leaked rather than freed under it
+  if (inFlight == 0) {
+    for (int i = 0; i < URING_QUEUE_DEPTH; ++i) {
+      free(slots[i].data);
+    }
+  }
+}
+
+bool UringFile::openWrite() {
+  return openRing(O_WRONLY | O_CREAT);
+}
+
+bool UringFile::openTruncate() {
+  return openRing(O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+// Writes go to explicit offsets, so the file isn't opened for append
+bool UringFile::openRing(int flags) {
+  if (fd >= 0) {
+    return false;
+  }
+
+  int ret = io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0);
+  if (ret < 0) {
+    static bool logged = false;
+    if (!logged) {
+      logged = true;
+      LOG_OPER("io_uring is not available (%s), fs_type uring falls back "
+               "to posix", strerror(-ret));
+    }
+    return open(flags | O_APPEND);
+  }
+
+  if (!open(flags)) {
+    io_uring_queue_exit(&ring);
+    return false;
+  }
+  ringOpen = true;
+  filling = -1;
+  offset = size;
+  error = 0;
+  failedAt = ULONG_MAX;
+  return true;
+}
+
+void UringFile::close() {
+  if (ringOpen) {
+    if (fd >= 0) {
+      flush();
+      drain();
+      if (error) {
+        LOG_OPER("failed to write <%s>: %s", filename.c_str(), strerror(error));
+      }
+      // with everything back from the kernel, cut what the failed write
+      // left a hole before
+      if (inFlight == 0 && failedAt < size) {
+        if (ftruncate(fd, failedAt) == 0) {
+          LOG_OPER("truncated <%s> to %lu bytes after a failed write, "
+                   "losing %lu bytes", filename.c_str(), failedAt,
+                   size - failedAt);
+          size = failedAt;
+        } else {
+          LOG_OPER("failed to truncate <%s> to %lu bytes: %s",
+                   filename.c_str(), failedAt, strerror(errno));
+        }
+      }
+    }
+    if (inFlight == 0) {
+      io_uring_queue_exit(&ring);
+      ringOpen = false;
+    }
+  }
+  PosixFile::close();
+}
+
+bool UringFile::writev(const struct iovec* iov, int iovcnt) {
+  if (!ringOpen) {
+    return PosixFile::writev(iov, iovcnt);
+  }
+  if (fd < 0 || error) {
+    return false;
+  }
+
+  for (int i = 0; i < iovcnt; ++i) {
+    const char* data = (const char*)iov[i].iov_base;
+    unsigned long left = iov[i].iov_len;
+    while (left > 0) {
+      if (filling < 0 && (filling = freeSlot()) < 0) {
+        return false;
+      }
+      slot_t& slot = slots[filling];
+      unsigned long count = min(left, bufferSize - slot.length);
+      memcpy(slot.data + slot.length, data, count);
+      slot.length += count;
+      data += count;
+      left -= count;
+      size += count;
+      if (slot.length == bufferSize) {
+        submit();
+      }
+    }
+  }
+
+  reap(false);
+  return error == 0;
+}
+
+bool UringFile::flush() {
+  if (!ringOpen) {
+    return PosixFile::flush();
+  }
+  if (filling >= 0 && slots[filling].length > 0 && !error) {
+    submit();
+  }
+  reap(false);
+  return error == 0;
+}
+
+bool UringFile::sync() {
+  if (!ringOpen) {
+    return PosixFile::sync();
+  }
+  if (fd < 0) {
+    return false;
+  }
+  flush();
+  drain();
+  return !error && fdatasync(fd) == 0;
+}
+
+// Returns a slot that isn't in flight, waiting for one if it has to,
+// or -1 if a write failed
+int UringFile::freeSlot() {
+  while (!error) {
+    for (int i = 0; i < URING_QUEUE_DEPTH; ++i) {
+      slot_t& slot = slots[i];
+      if (slot.busy) {
+        continue;
+      }
+      if (!slot.data) {
+        void* aligned = NULL;
+        if (posix_memalign(&aligned, 4096, bufferSize) != 0) {
+          error = ENOMEM;
+          return -1;
+        }
+        slot.data = (char*)aligned;
+      }
+      slot.length = 0;
+      return i;
+    }
+    reap(true);
+  }
+  return -1;
+}
+
+// Submits the slot being filled
+void UringFile::submit() {
+  slot_t& slot = slots[filling];
+  filling = -1;
+  slot.offset = offset;
+  slot.written = 0;
+  slot.busy = true;
+  offset += slot.length;
+  ++inFlight;
+  queueWrite(&slot - slots);
+
+  int ret = io_uring_submit(&ring);
+  if (ret < 0) {
+    // the write is still queued in the ring, reap(true) submits it again
+    LOG_OPER("failed to submit write to <%s>: %s",
+             filename.c_str(), strerror(-ret));
+  }
+}
+
+// Queues what is left of a submitted slot. There is a submission entry
+// for every slot, so one is always available.
+void UringFile::queueWrite(int index) {
+  slot_t& slot = slots[index];
+  struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+  io_uring_prep_write(sqe, fd, slot.data + slot.written,
+                      slot.length - slot.written, slot.offset + slot.written);
+  io_uring_sqe_set_data(sqe, (void*)(long)index);
+}
+
+// Handles completed writes. With wait, submits whatever a failed submit
+// left queued and waits for at least one.
+void UringFile::reap(bool wait) {
+  while (inFlight > 0) {
+    struct io_uring_cqe* cqe;
+    int ret = 0;
+    if (wait) {
+      ret = io_uring_submit_and_wait(&ring, 1);
+    }
+    if (ret >= 0) {
+      ret = io_uring_peek_cqe(&ring, &cqe);
+    }
+    if (ret == -EINTR || (ret == -EAGAIN && wait)) {
+      continue;
+    }
+    if (ret == -EAGAIN) {
+      return;
+    }
+    if (ret < 0) {
+      LOG_OPER("failed to wait for writes to <%s>: %s",
+               filename.c_str(), strerror(-ret));
+      if (!error) {
+        error = -ret;
+      }
+      return;
+    }
+
+    slot_t& slot = slots[(long)io_uring_cqe_get_data(cqe)];
+    int res = cqe->res;
+    io_uring_cqe_seen(&ring, cqe);
+    wait = false;
+
+    if (res > 0) {
+      slot.written += res;
+      if (slot.written < slot.length) {
+        // short write, send the rest
+        queueWrite(&slot - slots);
+        ret = io_uring_submit(&ring);
+        if (ret < 0) {
+          LOG_OPER("failed to submit write to <%s>: %s",
+                   filename.c_str(), strerror(-ret));
+        }
+        continue;
+      }
+    } else {
+      if (!error) {
+        error = res < 0 ? -res : EIO;
+      }
+      failedAt = min(failedAt, slot.offset + slot.written);
+    }
+    slot.busy = false;
+    --inFlight;
+  }
+}
+
+// Waits for every write in flight
+void UringFile::drain() {
+  while (inFlight > 0) {
+    int before = inFlight;
+    reap(true);
+    if (inFlight == before && error) {
+      break;
+    }
+  }
+}
@@ -0,0 +1,98 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+
+#ifndef SCRIBE_URING_FILE_H
+#define SCRIBE_URING_FILE_H
+
+#include "file.h"
+
+#ifdef USE_SCRIBE_URING
+#include <liburing.h>
+
+#define URING_QUEUE_DEPTH 8
+
+/*
+ * fs_type=uring: a PosixFile that writes through io_uring, so that a slow
+ * disk doesn't hold up the store thread. Writes are copied into one of
+ * URING_QUEUE_DEPTH aligned buffers of write_buffer_size bytes, and a
+ * buffer is submitted at its own offset in the file once it is full or on
+ * flush(), so several can be in flight and complete in any order. writev()
+ * only waits when every buffer is in flight, and writev() and flush()
+ * collect whatever has completed without waiting. sync() and close() wait
+ * for everything.
+ *
+ * writev() returns once the data is copied, so FileStore acknowledges a
+ * batch before it is on disk, unless sync_policy=per_batch has it wait.
+ * A failed write is reported by the next writev(), flush() or sync(), which
+ * makes FileStore close the file and retry that batch on a new one. close()
+ * cuts the file back to where the first failed write started, so that
+ * writes that completed after it don't leave a hole that reads as the end
+ * of the file. Everything from there on is lost, including the parts of
+ * earlier, acknowledged batches that were in flight, and the cut can
+ * leave a partial message at the end. The log says where the file was cut.
+ *
+ * Reads are PosixFile's. If io_uring can't be set up, the file falls back
+ * to plain PosixFile writes.
+ */
+class UringFile : public PosixFile {
+ public:
+  UringFile(const std::string& name, bool framed);
+  virtual ~UringFile();
+
+  bool openWrite();
+  bool openTruncate();
+  void close();
+  bool writev(const struct iovec* iov, int iovcnt);
+  bool flush();
+  bool sync();
+
+ private:
+  struct slot_t {
+    char* data;
+    unsigned long length;   // bytes copied in
+    unsigned long written;  // bytes the kernel has written so far
+    unsigned long offset;   // in the file
+    bool busy;              // submitted and not completed
+  };
+
+  bool openRing(int flags);
+  int freeSlot();
+  void submit();
+  void queueWrite(int index);
+  void reap(bool wait);
+  void drain();
+
+  struct io_uring ring;
+  bool ringOpen;
+  slot_t slots[URING_QUEUE_DEPTH];
+  int filling;            // slot being filled, or -1
+  int inFlight;
+  unsigned long offset;   // where the next submitted slot goes
+  int error;              // errno of the first failed write since open
+  unsigned long failedAt; // where the first failed write started
+
+  // disallow copy, assignment, and empty construction
+  UringFile();
+  UringFile(UringFile& rhs);
+  UringFile& operator=(UringFile& rhs);
+};
+
+#endif // USE_SCRIBE_URING
+
+#endif // SCRIBE_URING_FILE_H
@@ -0,0 +1,130 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include "common.h"
+#include "async_queue.h"
+
+AsyncQueue::AsyncQueue(unsigned long min_capacity)
+  : capacity(1),
+    enqueuePos(0),
+    dequeuePos(0) {
+  while (capacity < min_capacity) {
+    capacity <<= 1;
+  }
+  mask = capacity - 1;
+
+  cells = new cell_t[capacity];
+  for (unsigned long i = 0; i < capacity; ++i) {
+    cells[i].sequence = i;
+    cells[i].batch = NULL;
+  }
+
+  sem_init(&freeSlots, 0, capacity);
+  sem_init(&usedSlots, 0, 0);
+}
+
+AsyncQueue::~AsyncQueue() {
+  sem_destroy(&freeSlots);
+  sem_destroy(&usedSlots);
+  delete[] cells;
+}
+
+bool AsyncQueue::push(async_batch_t* batch, bool block) {
+  if (block) {
+    while (sem_wait(&freeSlots) != 0 && errno == EINTR) {
+    }
+  } else if (sem_trywait(&freeSlots) != 0) {
+    return false;
+  }
+
+  // A slot is free, but it may not be the next one yet if consumers
+  // finish out of order. That only lasts until they return.
+  while (!tryPush(batch)) {
+    sched_yield();
+  }
+
+  sem_post(&usedSlots);
+  return true;
+}
+
+async_batch_t* AsyncQueue::pop() {
+  while (sem_wait(&usedSlots) != 0 && errno == EINTR) {
+  }
+
+  async_batch_t* batch;
+  while ((batch = tryPop()) == NULL) {
+    sched_yield();
+  }
+
+  sem_post(&freeSlots);
+  return batch;
+}
+
+bool AsyncQueue::tryPush(async_batch_t* batch) {
+  unsigned long pos = enqueuePos;
+  cell_t* cell;
+
+  for (;;) {
+    cell = &cells[pos & mask];
+    long diff = (long)cell->sequence - (long)pos;
+    if (diff == 0) {
+      // the cell is free, claim it
+      if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos + 1)) {
+        break;
+      }
+      pos = enqueuePos;
+    } else if (diff < 0) {
+      // the cell still holds a batch from the previous lap
+      return false;
+    } else {
+      // another producer claimed it
+      pos = enqueuePos;
+    }
+  }
+
+  cell->batch = batch;
+  __sync_synchronize();
+  cell->sequence = pos + 1;
+  return true;
+}
+
+async_batch_t* AsyncQueue::tryPop() {
+  unsigned long pos = dequeuePos;
+  cell_t* cell;
+
+  for (;;) {
+    cell = &cells[pos & mask];
+    long diff = (long)cell->sequence - (long)(pos + 1);
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&dequeuePos, pos, pos + 1)) {
+        break;
+      }
+      pos = dequeuePos;
+    } else if (diff < 0) {
+      // the producer hasn't finished writing this cell
+      return NULL;
+    } else {
+      pos = dequeuePos;
+    }
+  }
+
+  async_batch_t* batch = cell->batch;
+  __sync_synchronize();
+  cell->sequence = pos + capacity;
+  return batch;
+}
@@ -0,0 +1,77 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_ASYNC_QUEUE_H
+#define SCRIBE_ASYNC_QUEUE_H
+
+#include "common.h"
+
+struct async_batch_t;
+
+/*
+ * Bounded multi-producer, multi-consumer ring that hands LogAsync() batches
+ * from Thrift workers to the dispatcher threads.
+ * Slots are claimed with a CAS on a position counter and handed over with a
+ * per-slot sequence number, so producers and consumers don't share a lock.
+ * Two semaphores count free and used slots for waiting when the ring is
+ * full or empty.
+ */
+class AsyncQueue {
+ public:
+  explicit AsyncQueue(unsigned long capacity); // rounded up to a power of 2
+  ~AsyncQueue();
+
+  // Returns false if the ring is full and block is false
+  bool push(async_batch_t* batch, bool block);
+
+  // Waits until there is a batch
+  async_batch_t* pop();
+
+  inline unsigned long getCapacity() const {
+    return capacity;
+  }
+
+ private:
+  bool tryPush(async_batch_t* batch);
+  async_batch_t* tryPop();
+
+  struct cell_t {
+    volatile unsigned long sequence;
+    async_batch_t* batch;
+  };
+
+  unsigned long capacity;
+  unsigned long mask;
+  cell_t* cells;
+
+  // producers and consumers update these, keep them on separate cache lines
+  char padding0[64];
+  volatile unsigned long enqueuePos;
+  char padding1[64];
+  volatile unsigned long dequeuePos;
+  char padding2[64];
+
+  sem_t freeSlots;
+  sem_t usedSlots;
+
+  // disallow copy and assignment
+  AsyncQueue(const AsyncQueue& rhs);
+  const AsyncQueue& operator=(const AsyncQueue& rhs);
+};
+
+#endif // SCRIBE_ASYNC_QUEUE_H
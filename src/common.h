@@ -29,6 +29,7 @@
 #include <queue>
 #include <vector>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <map>
 #include <set>
@@ -25,6 +25,8 @@
 #include "scribe_server.h"
 #include "conn_pool.h"
 
+#include <arpa/inet.h>
+
 using std::string;
 using std::ostringstream;
 using std::map;
@@ -44,42 +46,57 @@ ConnPool::~ConnPool() {
   pthread_mutex_destroy(&mapMutex);
 }
 
-string ConnPool::makeKey(const string& hostname, unsigned long port) {
+string ConnPool::makeKey(const string& hostname, unsigned long port,
+                         const wire_format_t& wire) {
   string key(hostname);
   key += ":";
 
   ostringstream oss;
   oss << port;
   key += oss.str();
-  return key;
+  return makeKey(key, wire);
 }
 
-bool ConnPool::open(const string& hostname, unsigned long port, int timeout) {
-        return openCommon(makeKey(hostname, port),
-                    shared_ptr<scribeConn>(new scribeConn(hostname, port, timeout)));
+// Stores that talk to the same server in different wire formats need
+// their own connections
+string ConnPool::makeKey(const string& service, const wire_format_t& wire) {
+  if (wire.isDefault()) {
+    return service;
+  }
+  return service + "/" + wire.toString();
 }
 
-bool ConnPool::open(const string &service, const server_vector_t &servers, int timeout) {
-        return openCommon(service,
-                    shared_ptr<scribeConn>(new scribeConn(service, servers, timeout)));
+bool ConnPool::open(const string& hostname, unsigned long port, int timeout,
+                    const wire_format_t& wire) {
+        return openCommon(makeKey(hostname, port, wire),
+                    shared_ptr<scribeConn>(new scribeConn(hostname, port, timeout, wire)));
 }
 
-void ConnPool::close(const string& hostname, unsigned long port) {
-  closeCommon(makeKey(hostname, port));
+bool ConnPool::open(const string &service, const server_vector_t &servers,
+                    int timeout, const wire_format_t& wire) {
+        return openCommon(makeKey(service, wire),
+                    shared_ptr<scribeConn>(new scribeConn(service, servers, timeout, wire)));
 }
 
-void ConnPool::close(const string &service) {
-  closeCommon(service);
+void ConnPool::close(const string& hostname, unsigned long port,
+                     const wire_format_t& wire) {
+  closeCommon(makeKey(hostname, port, wire));
+}
+
+void ConnPool::close(const string &service, const wire_format_t& wire) {
+  closeCommon(makeKey(service, wire));
 }
 
 int ConnPool::send(const string& hostname, unsigned long port,
-                    shared_ptr<logentry_vector_t> messages) {
-  return sendCommon(makeKey(hostname, port), messages);
+                    shared_ptr<logentry_vector_t> messages,
+                    const wire_format_t& wire) {
+  return sendCommon(makeKey(hostname, port, wire), messages);
 }
 
 int ConnPool::send(const string &service,
-                    shared_ptr<logentry_vector_t> messages) {
-  return sendCommon(service, messages);
+                    shared_ptr<logentry_vector_t> messages,
+                    const wire_format_t& wire) {
+  return sendCommon(makeKey(service, wire), messages);
 }
 
 bool ConnPool::openCommon(const string &key, shared_ptr<scribeConn> conn) {
@@ -158,21 +175,27 @@ int ConnPool::sendCommon(const string &key,
   }
 }
 
-scribeConn::scribeConn(const string& hostname, unsigned long port, int timeout_)
+scribeConn::scribeConn(const string& hostname, unsigned long port, int timeout_,
+                       const wire_format_t& wire)
   : refCount(1),
   serviceBased(false),
   remoteHost(hostname),
   remotePort(port),
-  timeout(timeout_) {
+  timeout(timeout_),
+  wireFormat(wire),
+  sentCounter(g_Handler->getCounterHandle("sent")) {
   pthread_mutex_init(&mutex, NULL);
 }
 
-scribeConn::scribeConn(const string& service, const server_vector_t &servers, int timeout_)
+scribeConn::scribeConn(const string& service, const server_vector_t &servers,
+                       int timeout_, const wire_format_t& wire)
   : refCount(1),
   serviceBased(true),
   serviceName(service),
   serverList(servers),
-  timeout(timeout_) {
+  timeout(timeout_),
+  wireFormat(wire),
+  sentCounter(g_Handler->getCounterHandle("sent")) {
   pthread_mutex_init(&mutex, NULL);
 }
 
@@ -238,12 +261,16 @@ bool scribeConn::open() {
     if (!framedTransport) {
       throw std::runtime_error("Failed to create framed transport");
     }
-    protocol = shared_ptr<TBinaryProtocol>(new TBinaryProtocol(framedTransport));
-    if (!protocol) {
-      throw std::runtime_error("Failed to create protocol");
+    if (wireFormat.codec == CODEC_NONE) {
+      protocol = createProtocol(framedTransport);
+      resendClient = shared_ptr<scribeClient>(new scribeClient(protocol));
+    } else {
+      requestBuffer = shared_ptr<TMemoryBuffer>(new TMemoryBuffer());
+      responseBuffer = shared_ptr<TMemoryBuffer>(new TMemoryBuffer());
+      protocol = createProtocol(requestBuffer);
+      resendClient = shared_ptr<scribeClient>(
+        new scribeClient(createProtocol(responseBuffer), protocol));
     }
-    protocol->setStrict(false, false);
-    resendClient = shared_ptr<scribeClient>(new scribeClient(protocol));
     if (!resendClient) {
       throw std::runtime_error("Failed to create network client");
     }
@@ -261,11 +288,21 @@ bool scribeConn::open() {
              connectionString().c_str(), stx.what());
     return false;
   }
-  LOG_OPER("Opened connection to remote scribe server %s",
-           connectionString().c_str());
+  LOG_OPER("Opened connection to remote scribe server %s (%s)",
+           connectionString().c_str(), wireFormat.toString().c_str());
   return true;
 }
 
+shared_ptr<TProtocol>
+scribeConn::createProtocol(shared_ptr<TTransport> transport) {
+  if (wireFormat.compact) {
+    return shared_ptr<TProtocol>(new TCompactProtocol(transport));
+  }
+  shared_ptr<TBinaryProtocol> binary(new TBinaryProtocol(transport));
+  binary->setStrict(false, false);
+  return binary;
+}
+
 void scribeConn::close() {
   try {
     framedTransport->close();
@@ -297,10 +334,14 @@ scribeConn::send(boost::shared_ptr<logentry_vector_t> messages) {
   }
   ResultCode result = TRY_LATER;
   try {
-    result = resendClient->Log(msgs);
+    if (wireFormat.codec == CODEC_NONE) {
+      result = resendClient->Log(msgs);
+    } else {
+      result = sendCompressed(msgs);
+    }
 
     if (result == OK) {
-      g_Handler->incCounter("sent", size);
+      sentCounter->add(size);
       LOG_OPER("Successfully sent <%d> messages to remote scribe server %s",
           size, connectionString().c_str());
       return (CONN_OK);
@@ -331,6 +372,42 @@ scribeConn::send(boost::shared_ptr<logentry_vector_t> messages) {
   return (CONN_TRANSIENT);
 }
 
+ResultCode scribeConn::sendCompressed(const std::vector<LogEntry>& msgs) {
+  uint8_t* data;
+  uint32_t size;
+  string frame;
+
+  requestBuffer->resetBuffer();
+  resendClient->send_Log(msgs);
+  requestBuffer->getBuffer(&data, &size);
+  if (!compressFrame(wireFormat.codec, data, size, frame)) {
+    throw TTransportException("failed to compress request");
+  }
+
+  uint32_t frame_size = htonl(frame.size());
+  socket->write((const uint8_t*)&frame_size, sizeof(frame_size));
+  socket->write((const uint8_t*)frame.data(), frame.size());
+  socket->flush();
+
+  socket->readAll((uint8_t*)&frame_size, sizeof(frame_size));
+  frame_size = ntohl(frame_size);
+  if (frame_size > MAX_UNCOMPRESSED_FRAME) {
+    throw TTransportException("reply frame too large");
+  }
+  frame.resize(frame_size);
+  if (frame_size > 0) {
+    socket->readAll((uint8_t*)&frame[0], frame_size);
+  }
+
+  string reply;
+  if (!decompressFrame((const uint8_t*)frame.data(), frame.size(), reply)) {
+    throw TTransportException("corrupt reply frame");
+  }
+  responseBuffer->resetBuffer((uint8_t*)reply.data(), reply.size(),
+                              TMemoryBuffer::COPY);
+  return resendClient->recv_Log();
+}
+
 std::string scribeConn::connectionString() {
         if (serviceBased) {
                 return "<" + remoteHost + " Service: " + serviceName + ">";
@@ -23,6 +23,9 @@
 #define SCRIBE_CONN_POOL_H
 
 #include "common.h"
+#include "wire_format.h"
+
+class CounterHandle;
 
 /* return codes for ScribeConn and ConnPool */
 #define CONN_FATAL        (-1) /* fatal error. close everything */
@@ -32,8 +35,10 @@
 // Basic scribe class to manage network connections. Used by network store
 class scribeConn {
  public:
-  scribeConn(const std::string& host, unsigned long port, int timeout);
-  scribeConn(const std::string &service, const server_vector_t &servers, int timeout);
+  scribeConn(const std::string& host, unsigned long port, int timeout,
+             const wire_format_t& wire = wire_format_t());
+  scribeConn(const std::string &service, const server_vector_t &servers,
+             int timeout, const wire_format_t& wire = wire_format_t());
   virtual ~scribeConn();
 
   void addRef();
@@ -51,11 +56,20 @@ class scribeConn {
 
  private:
   std::string connectionString();
+  boost::shared_ptr<apache::thrift::protocol::TProtocol> createProtocol(
+    boost::shared_ptr<apache::thrift::transport::TTransport> transport);
+  // Log() over compressed frames, throws TTransportException on failure
+  scribe::thrift::ResultCode sendCompressed(
+    const std::vector<scribe::thrift::LogEntry>& messages);
 
  protected:
   boost::shared_ptr<apache::thrift::transport::TSocket> socket;
   boost::shared_ptr<apache::thrift::transport::TFramedTransport> framedTransport;
-  boost::shared_ptr<apache::thrift::protocol::TBinaryProtocol> protocol;
+  boost::shared_ptr<apache::thrift::protocol::TProtocol> protocol;
+  // with compression the client reads and writes these buffers and
+  // the frames are compressed and sent by sendCompressed()
+  boost::shared_ptr<apache::thrift::transport::TMemoryBuffer> requestBuffer;
+  boost::shared_ptr<apache::thrift::transport::TMemoryBuffer> responseBuffer;
   boost::shared_ptr<scribe::thrift::scribeClient> resendClient;
 
   unsigned refCount;
@@ -66,10 +80,13 @@ class scribeConn {
   std::string remoteHost;
   unsigned long remotePort;
   int timeout; // connection, send, and recv timeout
+  wire_format_t wireFormat;
+  CounterHandle* sentCounter;
   pthread_mutex_t mutex;
 };
 
-// key is hostname:port or the service
+// key is hostname:port or the service, followed by the wire format
+// if it isn't the default
 typedef std::map<std::string, boost::shared_ptr<scribeConn> > conn_map_t;
 
 // Scribe class to manage connection pooling
@@ -82,16 +99,22 @@ class ConnPool {
   ConnPool();
   virtual ~ConnPool();
 
-  bool open(const std::string& host, unsigned long port, int timeout);
-  bool open(const std::string &service, const server_vector_t &servers, int timeout);
+  bool open(const std::string& host, unsigned long port, int timeout,
+            const wire_format_t& wire = wire_format_t());
+  bool open(const std::string &service, const server_vector_t &servers,
+            int timeout, const wire_format_t& wire = wire_format_t());
 
-  void close(const std::string& host, unsigned long port);
-  void close(const std::string &service);
+  void close(const std::string& host, unsigned long port,
+             const wire_format_t& wire = wire_format_t());
+  void close(const std::string &service,
+             const wire_format_t& wire = wire_format_t());
 
   int send(const std::string& host, unsigned long port,
-            boost::shared_ptr<logentry_vector_t> messages);
+            boost::shared_ptr<logentry_vector_t> messages,
+            const wire_format_t& wire = wire_format_t());
   int send(const std::string &service,
-            boost::shared_ptr<logentry_vector_t> messages);
+            boost::shared_ptr<logentry_vector_t> messages,
+            const wire_format_t& wire = wire_format_t());
 
  private:
   bool openCommon(const std::string &key, boost::shared_ptr<scribeConn> conn);
@@ -100,7 +123,9 @@ class ConnPool {
                   boost::shared_ptr<logentry_vector_t> messages);
 
  protected:
-  std::string makeKey(const std::string& name, unsigned long port);
+  std::string makeKey(const std::string& name, unsigned long port,
+                      const wire_format_t& wire);
+  std::string makeKey(const std::string& service, const wire_format_t& wire);
 
   pthread_mutex_t mapMutex;
   conn_map_t connMap;
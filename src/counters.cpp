@@ -0,0 +1,242 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include "common.h"
+#include "counters.h"
+
+using namespace apache::thrift::concurrency;
+using namespace facebook::fb303;
+using namespace std;
+
+// Threads are given shards round robin the first time they count anything
+static volatile unsigned long nextShard = 0;
+static __thread int threadShard = -1;
+
+static inline int getThreadShard() {
+  if (threadShard < 0) {
+    threadShard = __sync_fetch_and_add(&nextShard, 1) % COUNTER_SHARDS;
+  }
+  return threadShard;
+}
+
+ShardedCounter::ShardedCounter(const string& counter_key)
+  : key(counter_key),
+    shards(NULL) {
+  void* aligned = NULL;
+  if (posix_memalign(&aligned, COUNTER_CACHE_LINE,
+                     COUNTER_SHARDS * sizeof(shard_t)) != 0) {
+    throw std::bad_alloc();
+  }
+  shards = (shard_t*)aligned;
+  for (int i = 0; i < COUNTER_SHARDS; ++i) {
+    shards[i].value = 0;
+  }
+}
+
+ShardedCounter::~ShardedCounter() {
+  free(shards);
+}
+
+void ShardedCounter::add(long amount) {
+  // Still atomic, since collect() and threads that share a shard can
+  // touch it at the same time, but the cache line is normally only
+  // used by this thread.
+  __sync_fetch_and_add(&shards[getThreadShard()].value, amount);
+}
+
+long ShardedCounter::collect() {
+  long total = 0;
+  for (int i = 0; i < COUNTER_SHARDS; ++i) {
+    if (shards[i].value != 0) {
+      total += __sync_lock_test_and_set(&shards[i].value, 0);
+    }
+  }
+  return total;
+}
+
+CounterHandle::CounterHandle(const string& category_key,
+                             ShardedCounter* overall_counter)
+  : categoryKey(category_key),
+    value(0),
+    overall(overall_counter) {
+}
+
+const unsigned long LatencyHistogram::bounds[NUM_BUCKETS - 1] =
+  {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+
+void LatencyHistogram::add(unsigned long msec, unsigned long count) {
+  int bucket = 0;
+  while (bucket < NUM_BUCKETS - 1 && msec > bounds[bucket]) {
+    ++bucket;
+  }
+  buckets[bucket]->add(count);
+  sum->add(msec * count);
+}
+
+string LatencyHistogram::bucketSuffix(int bucket) {
+  ostringstream suffix;
+  if (bucket < NUM_BUCKETS - 1) {
+    suffix << " <=" << bounds[bucket];
+  } else {
+    suffix << " >" << bounds[bucket - 1];
+  }
+  return suffix.str();
+}
+
+void LatencyHistogram::summarize(FacebookBase& fb303, const string& key,
+                                 snapshot_t& last) {
+  int64_t counts[NUM_BUCKETS];
+  int64_t total = 0;
+  for (int i = 0; i < NUM_BUCKETS; ++i) {
+    // not scribeHandler::getCounter(), which folds every time
+    int64_t count = fb303.FacebookBase::getCounter(key + bucketSuffix(i));
+    counts[i] = count - last.counts[i];
+    last.counts[i] = count;
+    total += counts[i];
+  }
+  int64_t sum = fb303.FacebookBase::getCounter(key + " sum");
+  int64_t window_sum = sum - last.sum;
+  last.sum = sum;
+
+  fb303.setCounter(key + " avg", total == 0 ? 0 : window_sum / total);
+
+  const int percentiles[] = {50, 99};
+  for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); ++p) {
+    int64_t seen = 0;
+    int bucket = 0;
+    while (bucket < NUM_BUCKETS - 1) {
+      seen += counts[bucket];
+      if (seen * 100 >= total * percentiles[p]) {
+        break;
+      }
+      ++bucket;
+    }
+    ostringstream name;
+    name << key << " p" << percentiles[p];
+    fb303.setCounter(name.str(), total == 0 ? 0 :
+                     bounds[min(bucket, NUM_BUCKETS - 2)]);
+  }
+}
+
+CounterRegistry::CounterRegistry() {
+}
+
+CounterRegistry::~CounterRegistry() {
+  for (counter_map_t::iterator iter = handles.begin();
+       iter != handles.end();
+       ++iter) {
+    delete iter->second;
+  }
+  for (map<string, ShardedCounter*>::iterator iter = overallCounters.begin();
+       iter != overallCounters.end();
+       ++iter) {
+    delete iter->second;
+  }
+  for (histogram_map_t::iterator iter = histograms.begin();
+       iter != histograms.end();
+       ++iter) {
+    delete iter->second;
+  }
+}
+
+CounterHandle* CounterRegistry::get(const string& category_key,
+                                    const string& overall_key) {
+  Guard monitor(lock);
+  return getLocked(category_key, overall_key);
+}
+
+LatencyHistogram* CounterRegistry::getHistogram(const string& category_key,
+                                                const string& overall_key) {
+  Guard monitor(lock);
+
+  LatencyHistogram*& histogram =
+    histograms[make_pair(category_key, overall_key)];
+  if (histogram == NULL) {
+    histogram = new LatencyHistogram();
+    for (int i = 0; i < LatencyHistogram::NUM_BUCKETS; ++i) {
+      string bucket = LatencyHistogram::bucketSuffix(i);
+      histogram->buckets[i] = getLocked(
+        category_key.empty() ? category_key : category_key + bucket,
+        overall_key + bucket);
+    }
+    histogram->sum = getLocked(
+      category_key.empty() ? category_key : category_key + " sum",
+      overall_key + " sum");
+  }
+  return histogram;
+}
+
+CounterHandle* CounterRegistry::getLocked(const string& category_key,
+                                          const string& overall_key) {
+  CounterHandle*& handle = handles[make_pair(category_key, overall_key)];
+  if (handle == NULL) {
+    ShardedCounter*& overall = overallCounters[overall_key];
+    if (overall == NULL) {
+      overall = new ShardedCounter(overall_key);
+      overallList.push_back(overall);
+    }
+    handle = new CounterHandle(category_key, overall);
+    if (!category_key.empty()) {
+      categoryHandles.push_back(handle);
+    }
+  }
+  return handle;
+}
+
+void CounterRegistry::fold(FacebookBase& fb303) {
+  // Handles are never deleted, so the ones that exist now can be walked
+  // once lock is released
+  vector<CounterHandle*> category_handles;
+  vector<ShardedCounter*> overall_counters;
+  {
+    Guard monitor(lock);
+    category_handles = categoryHandles;
+    overall_counters = overallList;
+  }
+
+  for (vector<CounterHandle*>::iterator iter = category_handles.begin();
+       iter != category_handles.end();
+       ++iter) {
+    long amount = (*iter)->collect();
+    if (amount != 0) {
+      fb303.incrementCounter((*iter)->getCategoryKey(), amount);
+    }
+  }
+
+  for (vector<ShardedCounter*>::iterator iter = overall_counters.begin();
+       iter != overall_counters.end();
+       ++iter) {
+    long amount = (*iter)->collect();
+    if (amount != 0) {
+      fb303.incrementCounter((*iter)->getKey(), amount);
+    }
+  }
+}
+
+void CounterRegistry::summarize(FacebookBase& fb303, const string& key) {
+  Guard monitor(lock);
+
+  map<string, LatencyHistogram::snapshot_t>::iterator iter =
+    summaries.find(key);
+  if (iter == summaries.end()) {
+    LatencyHistogram::snapshot_t empty;
+    memset(&empty, 0, sizeof(empty));
+    iter = summaries.insert(make_pair(key, empty)).first;
+  }
+  LatencyHistogram::summarize(fb303, key, iter->second);
+}
@@ -0,0 +1,199 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_COUNTERS_H
+#define SCRIBE_COUNTERS_H
+
+#include "common.h"
+
+#define COUNTER_SHARDS 16
+#define COUNTER_CACHE_LINE 64
+
+/*
+ * The "scribe_overall:<counter>" part of counters, which every category
+ * adds to. add() goes to a per-thread shard, so threads don't contend on
+ * it. The shards are cache line aligned and there is one of these per
+ * overall key, not per category.
+ */
+class ShardedCounter {
+ public:
+  explicit ShardedCounter(const std::string& key);
+  ~ShardedCounter();
+
+  void add(long amount);
+
+  // returns the sum of all shards and clears them
+  long collect();
+
+  inline const std::string& getKey() const {
+    return key;
+  }
+
+ private:
+  // one cache line per shard
+  struct shard_t {
+    volatile long value;
+    char padding[COUNTER_CACHE_LINE - sizeof(long)];
+  };
+
+  std::string key;
+  shard_t* shards;
+
+  // disallow copy and assignment
+  ShardedCounter(const ShardedCounter& rhs);
+  const ShardedCounter& operator=(const ShardedCounter& rhs);
+};
+
+/*
+ * A counter for hot paths, resolved once through
+ * scribeHandler::getCounterHandle() and kept by the caller.
+ * add() doesn't allocate or build counter names. The category part is a
+ * plain atomic, so there are many of these cheaply, and the overall part
+ * is the ShardedCounter it shares with every category. CounterRegistry::
+ * fold() adds them to the fb303 counters "<category>:<counter>" and
+ * "scribe_overall:<counter>".
+ */
+class CounterHandle {
+ public:
+  CounterHandle(const std::string& category_key, ShardedCounter* overall);
+
+  inline void add(long amount) {
+    if (!categoryKey.empty()) {
+      __sync_fetch_and_add(&value, amount);
+    }
+    overall->add(amount);
+  }
+  inline void inc() {
+    add(1);
+  }
+
+  // returns what was counted for the category and clears it
+  inline long collect() {
+    return value != 0 ? __sync_lock_test_and_set(&value, 0) : 0;
+  }
+
+  inline const std::string& getCategoryKey() const {
+    return categoryKey;
+  }
+
+ private:
+  std::string categoryKey; // empty for counters that are only overall
+  volatile long value;
+  ShardedCounter* overall;
+
+  // disallow copy and assignment
+  CounterHandle(const CounterHandle& rhs);
+  const CounterHandle& operator=(const CounterHandle& rhs);
+};
+
+/*
+ * Latency histogram exported as fb303 counters. Every bucket is a
+ * CounterHandle named "<key> <=<bound>", or "<key> ><bound>" for the last
+ * one, counting the samples that fell into it, and "<key> sum" adds up
+ * all samples so that averages can be computed. Bounds are in msec, or
+ * counts for histograms of sizes, and roughly logarithmic so that the
+ * relative error is the same at every scale.
+ * Get one from CounterRegistry::getHistogram().
+ */
+class LatencyHistogram {
+ public:
+  static const int NUM_BUCKETS = 14;
+  // upper bound of each bucket except the last, which is unbounded
+  static const unsigned long bounds[NUM_BUCKETS - 1];
+
+  // count samples of msec each
+  void add(unsigned long msec, unsigned long count = 1);
+
+  // " <=<bound>" or " ><bound>"
+  static std::string bucketSuffix(int bucket);
+
+  // fb303 counters of a histogram as of some point, see summarize()
+  struct snapshot_t {
+    int64_t counts[NUM_BUCKETS];
+    int64_t sum;
+  };
+
+  // Sets the fb303 counters "<key> avg", "<key> p50" and "<key> p99" from
+  // the samples the histogram with key has counted since last, and
+  // updates last. A percentile is the bound of the bucket it falls in,
+  // the last bound if it is above all of them, and everything is 0
+  // without samples.
+  static void summarize(facebook::fb303::FacebookBase& fb303,
+                        const std::string& key, snapshot_t& last);
+
+ private:
+  friend class CounterRegistry;
+  LatencyHistogram() {}
+
+  CounterHandle* buckets[NUM_BUCKETS];
+  CounterHandle* sum;
+
+  // disallow copy and assignment
+  LatencyHistogram(const LatencyHistogram& rhs);
+  const LatencyHistogram& operator=(const LatencyHistogram& rhs);
+};
+
+/*
+ * Owns all CounterHandles and ShardedCounters. Handles are never deleted,
+ * so callers can keep the pointers for the lifetime of the process.
+ */
+class CounterRegistry {
+ public:
+  CounterRegistry();
+  ~CounterRegistry();
+
+  // Returns the handle for these fb303 keys, creating it if needed.
+  // An empty category_key gives a counter that is only counted overall.
+  CounterHandle* get(const std::string& category_key,
+                     const std::string& overall_key);
+
+  // Same for a histogram with buckets under these keys
+  LatencyHistogram* getHistogram(const std::string& category_key,
+                                 const std::string& overall_key);
+
+  // Adds everything counted since the last fold to fb303. The handles are
+  // collected without holding lock, so creating new ones isn't held up.
+  void fold(facebook::fb303::FacebookBase& fb303);
+
+  // Summarizes the histogram with the fb303 key over what it counted
+  // since the last call for key, see LatencyHistogram::summarize()
+  void summarize(facebook::fb303::FacebookBase& fb303,
+                 const std::string& key);
+
+ private:
+  typedef std::map<std::pair<std::string, std::string>, CounterHandle*>
+    counter_map_t;
+  typedef std::map<std::pair<std::string, std::string>, LatencyHistogram*>
+    histogram_map_t;
+
+  // Must be called while holding lock
+  CounterHandle* getLocked(const std::string& category_key,
+                           const std::string& overall_key);
+
+  counter_map_t handles;
+  std::map<std::string, ShardedCounter*> overallCounters;
+  histogram_map_t histograms;
+  // the handles that count for a category and every ShardedCounter, in
+  // the order they were created, for fold()
+  std::vector<CounterHandle*> categoryHandles;
+  std::vector<ShardedCounter*> overallList;
+  std::map<std::string, LatencyHistogram::snapshot_t> summaries;
+  apache::thrift::concurrency::Mutex lock;
+};
+
+#endif // SCRIBE_COUNTERS_H
@@ -23,6 +23,8 @@
 
 #include "common.h"
 #include "scribe_server.h"
+#include "line_listener.h"
+#include "wire_format.h"
 
 using namespace apache::thrift;
 using namespace apache::thrift::protocol;
@@ -35,8 +37,13 @@ using namespace scribe::concurrency;
 
 using boost::shared_ptr;
 
-void serve(shared_ptr<TNonblockingServer> server, const std::string &ip, unsigned long int port);
-void listenSocket(shared_ptr<TNonblockingServer> server, const char *ip_, unsigned long int port_);
+typedef std::vector<shared_ptr<TNonblockingServer> > server_list_t;
+
+void serve(const server_list_t& servers, const std::string &ip, unsigned long int port);
+void* ioThread(void *server_ptr);
+void* foldCountersThread(void *arg);
+void listenSocket(shared_ptr<TNonblockingServer> server, const char *ip_, unsigned long int port_,
+                  bool reuse_port);
 
 /*
  * Network configuration and directory services
@@ -74,6 +81,20 @@ unsigned long scribe::clock::nowInMsec() {
   return ((unsigned long)sec) * 1000 + (tv.tv_usec / 1000);
 }
 
+unsigned long scribe::clock::monotonicInMsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((unsigned long)ts.tv_sec) * 1000 + (ts.tv_nsec / 1000000);
+}
+
+unsigned long scribe::clock::monotonicInUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((unsigned long)ts.tv_sec) * 1000000 + (ts.tv_nsec / 1000);
+}
+
 /*
  * Hash functions
  */
@@ -100,7 +121,10 @@ uint32_t scribe::strhash::hash32(const char *s) {
  */
 // note: this function uses global g_Handler.
 void scribe::startServer() {
-  boost::shared_ptr<TProcessor> processor(new scribeProcessor(g_Handler));
+  // Compact and compressed frames are unpacked by WireFormatProcessor,
+  // everything else is read with the binary protocol as before.
+  boost::shared_ptr<TProcessor> processor(new WireFormatProcessor(
+    boost::shared_ptr<TProcessor>(new scribeProcessor(g_Handler))));
   /* This factory is for binary compatibility. */
   boost::shared_ptr<TProtocolFactory> protocol_factory(
     new TBinaryProtocolFactory(0, 0, false, false)
@@ -118,29 +142,60 @@ void scribe::startServer() {
     thread_manager->start();
   }
 
-  shared_ptr<TNonblockingServer> server(new TNonblockingServer(
-                                          processor,
-                                          protocol_factory,
-                                          g_Handler->port,
-                                          thread_manager
-                                        ));
-  g_Handler->setServer(server);
+  size_t num_io_threads = g_Handler->numIoThreads;
+#ifndef SO_REUSEPORT
+  if (num_io_threads > 1) {
+    LOG_OPER("SO_REUSEPORT is not supported, ignoring num_io_threads %lu",
+             (unsigned long)num_io_threads);
+    num_io_threads = 1;
+  }
+#endif
 
-  LOG_OPER("Starting scribe server on port %lu", g_Handler->port);
+  // Every I/O thread gets its own server with its own socket and event
+  // loop. They share the processor and the ThreadManager.
+  server_list_t servers;
+  for (size_t i = 0; i < num_io_threads; ++i) {
+    shared_ptr<TNonblockingServer> server(new TNonblockingServer(
+                                            processor,
+                                            protocol_factory,
+                                            g_Handler->port,
+                                            thread_manager
+                                          ));
+    g_Handler->addServer(server);
+
+    // per connection rate limits, see max_conn_msg_per_second
+    server->setServerEventHandler(
+      shared_ptr<TServerEventHandler>(new ConnectionRateLimiter()));
+
+    servers.push_back(server);
+  }
+
+  LOG_OPER("Starting scribe server on port %lu with %lu I/O threads",
+           g_Handler->port, (unsigned long)num_io_threads);
   if (!g_Handler->ip.empty()) LOG_OPER("Binding to %s", g_Handler->ip.c_str());
   fflush(stderr);
 
-  // throttle concurrent connections
+  // throttle concurrent connections. Each I/O thread gets an equal share,
+  // rounded up, since the kernel spreads connections across their sockets.
   unsigned long mconn = g_Handler->getMaxConn();
   if (mconn > 0) {
-    LOG_OPER("Throttle max_conn to %lu", mconn);
+    unsigned long per_server = (mconn + servers.size() - 1) / servers.size();
+    LOG_OPER("Throttle max_conn to %lu, %lu per I/O thread", mconn, per_server);
 #ifdef T_OVERLOAD_CLOSE_ON_ACCEPT
-    server->setMaxConnections(mconn);
-    server->setOverloadAction(T_OVERLOAD_CLOSE_ON_ACCEPT);
+    for (size_t i = 0; i < servers.size(); ++i) {
+      servers[i]->setMaxConnections(per_server);
+      servers[i]->setOverloadAction(T_OVERLOAD_CLOSE_ON_ACCEPT);
+    }
 #endif
   }
 
-  serve(server, g_Handler->ip, g_Handler->port);
+  // line protocol and UDP listeners, see line_listener.h
+  shared_ptr<LineListener> line_listener(new LineListener());
+  if (line_listener->configure(g_Handler->getConfig(), g_Handler->ip)) {
+    line_listener->start();
+  }
+
+  serve(servers, g_Handler->ip, g_Handler->port);
   // this function never returns
 }
 
@@ -152,32 +207,77 @@ void scribe::stopServer() {
   exit(0);
 }
 
+// Adds counts from counter handles to fb303 every second, off the event
+// loops, since it walks every handle
+void* foldCountersThread(void *arg) {
+  while (true) {
+    sleep(1);
+    g_Handler->foldCounters();
+  }
+  return NULL;
+}
+
 /**
- * Main workhorse function, starts up the server listening on a port and
- * loops over the libevent handler.
+ * Main workhorse function, starts up the servers listening on a port and
+ * loops over the libevent handler. The first server runs in this thread,
+ * every other one in an I/O thread of its own.
  */
-void serve(shared_ptr<TNonblockingServer> server, const std::string &ip, unsigned long int port) {
-  // Init socket
-  listenSocket(server, ip.empty() ? NULL : ip.c_str(), port);
+void serve(const server_list_t& servers, const std::string &ip, unsigned long int port) {
+  // With more than one server, the kernel spreads connections over
+  // their sockets
+  bool reuse_port = servers.size() > 1;
 
-  if (server->isThreadPoolProcessing()) {
-    // Init task completion notification pipe
-    server->createNotificationPipe();
+  for (size_t i = 0; i < servers.size(); ++i) {
+    shared_ptr<TNonblockingServer> server = servers[i];
+
+    // Init socket
+    listenSocket(server, ip.empty() ? NULL : ip.c_str(), port, reuse_port);
+
+    if (server->isThreadPoolProcessing()) {
+      // Init task completion notification pipe
+      server->createNotificationPipe();
+    }
+
+    // Initialize libevent core, event_init() also sets the default base
+    event_base* base = (i == 0) ? static_cast<event_base*>(event_init())
+                                : event_base_new();
+    server->registerEvents(base);
   }
 
-  // Initialize libevent core
-  server->registerEvents(static_cast<event_base*>(event_init()));
+  shared_ptr<TNonblockingServer> main_server = servers[0];
+
+  // Start folding counters every second
+  pthread_t fold_thread;
+  if (pthread_create(&fold_thread, NULL, foldCountersThread, NULL) != 0) {
+    throw TException("serve() failed to create counter thread");
+  }
+  pthread_detach(fold_thread);
 
   // Run the preServe event
-  if (server->getEventHandler() != NULL) {
-    server->getEventHandler()->preServe();
+  if (main_server->getEventHandler() != NULL) {
+    main_server->getEventHandler()->preServe();
+  }
+
+  for (size_t i = 1; i < servers.size(); ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, ioThread, servers[i].get()) != 0) {
+      throw TException("serve() failed to create I/O thread");
+    }
+    pthread_detach(thread);
   }
 
   // Run libevent engine, never returns, invokes calls to eventHandler
+  event_base_loop(main_server->getEventBase(), 0);
+}
+
+void* ioThread(void *server_ptr) {
+  TNonblockingServer* server = static_cast<TNonblockingServer*>(server_ptr);
   event_base_loop(server->getEventBase(), 0);
+  return NULL;
 }
 
-void listenSocket(shared_ptr<TNonblockingServer> server, const char *ip_, unsigned long int port_) {
+void listenSocket(shared_ptr<TNonblockingServer> server, const char *ip_, unsigned long int port_,
+                  bool reuse_port) {
   int s;
   struct addrinfo hints, *res, *res0;
   int error;
@@ -226,6 +326,16 @@ void listenSocket(shared_ptr<TNonblockingServer> server, const char *ip_, unsign
   // Set reuseaddr to avoid 2MSL delay on server restart
   setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
+#ifdef SO_REUSEPORT
+  // Let every I/O thread bind its own socket to the same port
+  if (reuse_port &&
+      -1 == setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+    close(s);
+    freeaddrinfo(res0);
+    throw TException("TNonblockingServer::serve() SO_REUSEPORT");
+  }
+#endif
+
   if (bind(s, res->ai_addr, res->ai_addrlen) == -1) {
     close(s);
     freeaddrinfo(res0);
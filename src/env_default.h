@@ -21,6 +21,7 @@
 #define SCRIBE_ENV
 
 #include "thrift/protocol/TBinaryProtocol.h"
+#include "thrift/protocol/TCompactProtocol.h"
 #include "thrift/server/TNonblockingServer.h"
 #include "thrift/concurrency/ThreadManager.h"
 #include "thrift/concurrency/PosixThreadFactory.h"
@@ -39,7 +40,10 @@
 #include "src/gen-cpp/scribe.h"
 #include "src/gen-cpp/BucketStoreMapping.h"
 
-typedef boost::shared_ptr<scribe::thrift::LogEntry> logentry_ptr_t;
+// Log entries are shared by every StoreQueue a message is routed to, so they
+// are immutable once queued. Stores that rewrite messages (new_category,
+// remove_key) must build new entries rather than modify shared ones.
+typedef boost::shared_ptr<const scribe::thrift::LogEntry> logentry_ptr_t;
 typedef std::vector<logentry_ptr_t> logentry_vector_t;
 typedef std::vector<std::pair<std::string, int> > server_vector_t;
 
@@ -116,6 +120,10 @@ namespace concurrency {
 namespace clock {
   unsigned long nowInMsec();
 
+  // not affected by changes to the system time, use for intervals
+  unsigned long monotonicInMsec();
+  unsigned long monotonicInUsec();
+
 } // !namespace scribe::clock
 
 /*
@@ -22,10 +22,16 @@
 #include "common.h"
 #include "file.h"
 #include "HdfsFile.h"
+#include "UringFile.h"
+
+#include <fcntl.h>
+#include <limits.h>
 
 #define INITIAL_BUFFER_SIZE (64 * 1024)
 #define LARGE_BUFFER_SIZE (16 * INITIAL_BUFFER_SIZE) /* arbitrarily chosen */
 #define UINT_SIZE 4
+#define DEFAULT_POSIX_BUFFER_SIZE (64 * 1024)
+#define POSIX_BUFFER_ALIGNMENT 4096
 
 using namespace std;
 using boost::shared_ptr;
@@ -35,6 +41,20 @@ boost::shared_ptr<FileInterface> FileInterface::createFileInterface(const std::s
                                                                     bool framed) {
   if (0 == type.compare("std")) {
     return shared_ptr<FileInterface>(new StdFile(name, framed));
+  } else if (0 == type.compare("posix")) {
+    return shared_ptr<FileInterface>(new PosixFile(name, framed));
+  } else if (0 == type.compare("uring")) {
+#ifdef USE_SCRIBE_URING
+    return shared_ptr<FileInterface>(new UringFile(name, framed));
+#else
+    static bool logged = false;
+    if (!logged) {
+      logged = true;
+      LOG_OPER("fs_type uring needs scribe built with --enable-uring, "
+               "using posix");
+    }
+    return shared_ptr<FileInterface>(new PosixFile(name, framed));
+#endif
   } else if (0 == type.compare("hdfs")) {
     return shared_ptr<FileInterface>(new HdfsFile(name));
   } else {
@@ -58,11 +78,28 @@ FileInterface::FileInterface(const std::string& name, bool frame)
 FileInterface::~FileInterface() {
 }
 
+bool FileInterface::writev(const struct iovec* iov, int iovcnt) {
+  size_t size = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    size += iov[i].iov_len;
+  }
+  string data;
+  data.reserve(size);
+  for (int i = 0; i < iovcnt; ++i) {
+    data.append((const char*)iov[i].iov_base, iov[i].iov_len);
+  }
+  return write(data);
+}
+
 StdFile::StdFile(const std::string& name, bool frame)
-  : FileInterface(name, frame), inputBuffer(NULL), bufferSize(0) {
+  : FileInterface(name, frame), inputBuffer(NULL), bufferSize(0),
+    syncFd(-1) {
 }
 
 StdFile::~StdFile() {
+  if (syncFd >= 0) {
+    ::close(syncFd);
+  }
   if (inputBuffer) {
     delete[] inputBuffer;
     inputBuffer = NULL;
@@ -104,6 +141,10 @@ void StdFile::close() {
   if (file.is_open()) {
     file.close();
   }
+  if (syncFd >= 0) {
+    ::close(syncFd);
+    syncFd = -1;
+  }
 }
 
 string StdFile::getFrame(unsigned data_length) {
@@ -131,10 +172,47 @@ bool StdFile::write(const std::string& data) {
   return true;
 }
 
-void StdFile::flush() {
-  if (file.is_open()) {
-    file.flush();
+// Goes straight to the stream buffer, which writes large buffers out
+// together with what it holds without copying them.
+bool StdFile::writev(const struct iovec* iov, int iovcnt) {
+
+  if (!file.is_open()) {
+    return false;
+  }
+
+  for (int i = 0; i < iovcnt; ++i) {
+    file.write((const char*)iov[i].iov_base, iov[i].iov_len);
+  }
+  if (file.bad()) {
+    return false;
+  }
+  return true;
+}
+
+bool StdFile::flush() {
+  if (!file.is_open()) {
+    return true;
+  }
+  file.flush();
+  return !file.bad();
+}
+
+// fdatasync() through a descriptor of our own, it syncs the same file
+bool StdFile::sync() {
+  if (!file.is_open()) {
+    return false;
+  }
+  file.flush();
+  if (!file.good()) {
+    return false;
   }
+  if (syncFd < 0) {
+    syncFd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (syncFd < 0) {
+      return false;
+    }
+  }
+  return fdatasync(syncFd) == 0;
 }
 
 /*
@@ -294,3 +372,337 @@ void FileInterface::serializeUInt(unsigned data, char* buffer) {
     buffer[i] = (unsigned char)((data >> (8 * i)) & 0xFF);
   }
 }
+
+PosixFile::PosixFile(const std::string& name, bool frame)
+  : StdFile(name, frame),
+    fd(-1),
+    reading(false),
+    size(0),
+    bufferSize(DEFAULT_POSIX_BUFFER_SIZE),
+    fadvise(false),
+    buffer(NULL),
+    bufferStart(0),
+    bufferEnd(0),
+    readOffset(0) {
+}
+
+PosixFile::~PosixFile() {
+  close();
+  free(buffer);
+}
+
+void PosixFile::setBufferSize(unsigned long buffer_size) {
+  if (buffer_size && !buffer) {
+    bufferSize = buffer_size;
+  }
+}
+
+void PosixFile::setFadvise(bool advise) {
+  fadvise = advise;
+}
+
+bool PosixFile::allocateBuffer() {
+  void* aligned = NULL;
+  if (posix_memalign(&aligned, POSIX_BUFFER_ALIGNMENT, bufferSize) != 0) {
+    LOG_OPER("failed to allocate <%lu> byte buffer for <%s>",
+             bufferSize, filename.c_str());
+    return false;
+  }
+  buffer = (char*)aligned;
+  return true;
+}
+
+bool PosixFile::openRead() {
+  if (!open(O_RDONLY)) {
+    return false;
+  }
+  if (fadvise) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return true;
+}
+
+bool PosixFile::openWrite() {
+  // open file for write in append mode
+  return open(O_WRONLY | O_CREAT | O_APPEND);
+}
+
+bool PosixFile::openTruncate() {
+  // open an existing file for write and truncate its contents
+  return open(O_WRONLY | O_CREAT | O_APPEND | O_TRUNC);
+}
+
+bool PosixFile::open(int flags) {
+
+  if (fd >= 0) {
+    return false;
+  }
+
+  fd = ::open(filename.c_str(), flags | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat info;
+  size = (fstat(fd, &info) == 0) ? info.st_size : 0;
+  reading = (flags & O_ACCMODE) == O_RDONLY;
+  bufferStart = 0;
+  bufferEnd = 0;
+  readOffset = 0;
+  return true;
+}
+
+bool PosixFile::isOpen() {
+  return fd >= 0;
+}
+
+void PosixFile::close() {
+  if (fd < 0) {
+    return;
+  }
+  if (reading) {
+    if (fadvise) {
+      // read once, don't keep it in the page cache
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+  } else if (!flushBuffer()) {
+    LOG_OPER("closing <%s>, losing <%lu> buffered bytes",
+             filename.c_str(), bufferEnd);
+  }
+  ::close(fd);
+  fd = -1;
+}
+
+bool PosixFile::write(const std::string& data) {
+  struct iovec iov;
+  iov.iov_base = (void*)data.data();
+  iov.iov_len = data.length();
+  return writev(&iov, 1);
+}
+
+bool PosixFile::writev(const struct iovec* iov, int iovcnt) {
+
+  if (fd < 0 || reading) {
+    return false;
+  }
+
+  unsigned long total = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    total += iov[i].iov_len;
+  }
+
+  if (buffer || allocateBuffer()) {
+    if (bufferEnd + total <= bufferSize) {
+      for (int i = 0; i < iovcnt; ++i) {
+        memcpy(buffer + bufferEnd, iov[i].iov_base, iov[i].iov_len);
+        bufferEnd += iov[i].iov_len;
+      }
+      size += total;
+      return true;
+    }
+
+    if (bufferEnd > 0) {
+      // write out what is buffered together with these, the buffer is
+      // kept if that fails
+      vector<struct iovec> all;
+      all.reserve(iovcnt + 1);
+      struct iovec buffered;
+      buffered.iov_base = buffer;
+      buffered.iov_len = bufferEnd;
+      all.push_back(buffered);
+      all.insert(all.end(), iov, iov + iovcnt);
+      if (!writeOut(&all[0], all.size())) {
+        return false;
+      }
+      bufferEnd = 0;
+      size += total;
+      return true;
+    }
+  }
+
+  if (!writeOut(iov, iovcnt)) {
+    return false;
+  }
+  size += total;
+  return true;
+}
+
+// Writes all of iov, with as few writev() calls as IOV_MAX allows. If
+// that fails, the file is cut back to where it was, so that a retry
+// doesn't follow a torn write.
+bool PosixFile::writeOut(const struct iovec* iov, int iovcnt) {
+  // buffered data hasn't reached the file yet
+  unsigned long start = size - bufferEnd;
+  bool torn = false;
+  struct iovec chunk[IOV_MAX];
+  int next = 0;       // first buffer not completely written
+  size_t offset = 0;  // bytes of it already written
+  while (next < iovcnt) {
+    int count = 0;
+    for (int i = next; i < iovcnt && count < IOV_MAX; ++i) {
+      size_t skip = (i == next) ? offset : 0;
+      chunk[count].iov_base = (char*)iov[i].iov_base + skip;
+      chunk[count].iov_len = iov[i].iov_len - skip;
+      ++count;
+    }
+
+    ssize_t done = ::writev(fd, chunk, count);
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (torn) {
+        int saved = errno;
+        if (ftruncate(fd, start) != 0) {
+          LOG_OPER("failed to truncate <%s> to %lu bytes after a failed "
+                   "write: %s", filename.c_str(), start, strerror(errno));
+          struct stat info;
+          if (fstat(fd, &info) == 0) {
+            size = info.st_size + bufferEnd;
+          }
+        }
+        errno = saved;
+      }
+      return false;
+    }
+    torn = true;
+
+    size_t left = done;
+    while (next < iovcnt && left >= iov[next].iov_len - offset) {
+      left -= iov[next].iov_len - offset;
+      offset = 0;
+      ++next;
+    }
+    offset += left;
+  }
+  return true;
+}
+
+bool PosixFile::flushBuffer() {
+  if (reading || bufferEnd == 0) {
+    return true;
+  }
+  struct iovec buffered;
+  buffered.iov_base = buffer;
+  buffered.iov_len = bufferEnd;
+  if (!writeOut(&buffered, 1)) {
+    LOG_OPER("failed to write <%lu> buffered bytes to <%s>: %s",
+             (unsigned long)buffered.iov_len, filename.c_str(),
+             strerror(errno));
+    return false;
+  }
+  bufferEnd = 0;
+  return true;
+}
+
+bool PosixFile::flush() {
+  return fd < 0 || flushBuffer();
+}
+
+bool PosixFile::sync() {
+  if (fd < 0 || reading) {
+    return false;
+  }
+  return flushBuffer() && fdatasync(fd) == 0;
+}
+
+unsigned long PosixFile::fileSize() {
+  if (fd >= 0) {
+    return size;
+  }
+  struct stat info;
+  if (::stat(filename.c_str(), &info) != 0) {
+    return 0;
+  }
+  return info.st_size;
+}
+
+// Makes sure the buffer holds at least wanted bytes that haven't been read,
+// growing it for frames larger than it. Returns false if the file ends
+// before that.
+bool PosixFile::fill(unsigned long wanted) {
+  unsigned long have = bufferEnd - bufferStart;
+  if (have >= wanted) {
+    return true;
+  }
+  if (!buffer && !allocateBuffer()) {
+    return false;
+  }
+
+  if (wanted > bufferSize) {
+    char* old_buffer = buffer;
+    unsigned long old_size = bufferSize;
+    bufferSize = ((wanted + INITIAL_BUFFER_SIZE - 1) / INITIAL_BUFFER_SIZE) *
+                 INITIAL_BUFFER_SIZE;
+    if (bufferSize > LARGE_BUFFER_SIZE) {
+      LOG_OPER("WARNING: allocating large buffer Corruption? %lu", bufferSize);
+    }
+    if (!allocateBuffer()) {
+      buffer = old_buffer;
+      bufferSize = old_size;
+      return false;
+    }
+    memcpy(buffer, old_buffer + bufferStart, have);
+    free(old_buffer);
+  } else {
+    memmove(buffer, buffer + bufferStart, have);
+  }
+  bufferStart = 0;
+  bufferEnd = have;
+
+  while (bufferEnd < wanted) {
+    ssize_t got = ::read(fd, buffer + bufferEnd, bufferSize - bufferEnd);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    bufferEnd += got;
+    readOffset += got;
+  }
+  return true;
+}
+
+/*
+ * Same as StdFile::readNext(), read from buffer instead of the stream.
+ */
+long PosixFile::readNext(std::string& _return) {
+  if (fd < 0 || !reading) {
+    return 0;
+  }
+
+  // the bytes that won't be read after a problem at the current frame
+  unsigned long position = readOffset - (bufferEnd - bufferStart);
+  long loss = position < size ? -(long)(size - position) : 0;
+
+  if (!fill(UINT_SIZE)) {
+    /* end of file */
+    return 0;
+  }
+  long frame_size = unserializeUInt(buffer + bufferStart);
+  if (frame_size == 0) {
+    return 0;
+  }
+  // check if most signiifcant bit set - should never be set
+  if (frame_size >= INT_MAX) {
+    /* Definitely corrupted. Stop reading any further */
+    LOG_OPER("WARNING: Corruption Data Loss %ld bytes in %s", loss,
+             filename.c_str());
+    return loss;
+  }
+  bufferStart += UINT_SIZE;
+
+  if (!fill(frame_size)) {
+    loss += UINT_SIZE;
+    LOG_OPER("WARNING: Data Loss %ld bytes in %s", loss, filename.c_str());
+    return loss;
+  }
+  _return.assign(buffer + bufferStart, frame_size);
+  bufferStart += frame_size;
+  return frame_size;
+}
+
+void PosixFile::deleteFile() {
+  ::unlink(filename.c_str());
+}
@@ -24,6 +24,8 @@
 
 #include "common.h"
 
+#include <sys/uio.h>
+
 class FileInterface {
  public:
   FileInterface(const std::string& name, bool framed);
@@ -40,12 +42,25 @@ class FileInterface {
   virtual bool isOpen() = 0;
   virtual void close() = 0;
   virtual bool write(const std::string& data) = 0;
-  virtual void flush() = 0;
+  // Writes the buffers in order as one write. By default they are copied
+  // into a single string for write(), files that can write them as they
+  // are override it.
+  virtual bool writev(const struct iovec* iov, int iovcnt);
+  // Returns false if what was buffered couldn't be written
+  virtual bool flush() = 0;
+  // Makes what has been written durable, like fdatasync(). File types
+  // that can't only flush.
+  virtual bool sync() { return flush(); };
   virtual unsigned long fileSize() = 0;
   virtual long readNext(std::string& _return) = 0;
   virtual void deleteFile() = 0;
   virtual void listImpl(const std::string& path, std::vector<std::string>& _return) = 0;
   virtual std::string getFrame(unsigned data_size) {return std::string();};
+  // Hints for file types that can use them: how much to buffer in
+  // memory, 0 for the default, and whether to tell the kernel that the
+  // file is read once from start to end. Must be set before opening.
+  virtual void setBufferSize(unsigned long size) {};
+  virtual void setFadvise(bool fadvise) {};
   virtual bool createDirectory(std::string path) = 0;
   virtual bool createSymlink(std::string oldpath, std::string newpath) = 0;
 
@@ -68,7 +83,9 @@ class StdFile : public FileInterface {
   bool isOpen();
   void close();
   bool write(const std::string& data);
-  void flush();
+  bool writev(const struct iovec* iov, int iovcnt);
+  bool flush();
+  bool sync();
   unsigned long fileSize();
   long readNext(std::string& _return);
   void deleteFile();
@@ -83,6 +100,7 @@ class StdFile : public FileInterface {
   char* inputBuffer;
   unsigned bufferSize;
   std::fstream file;
+  int syncFd; // the fstream doesn't give its own
 
   // disallow copy, assignment, and empty construction
   StdFile();
@@ -90,4 +108,62 @@ class StdFile : public FileInterface {
   StdFile& operator=(StdFile& rhs);
 };
 
+/*
+ * fs_type=posix: a StdFile that reads and writes with plain file
+ * descriptors instead of an fstream. Writes are collected in an aligned
+ * buffer of setBufferSize() bytes and go out with one writev() when it
+ * fills up or on flush(), buffers that don't fit are written as they are
+ * after it. A write that fails is cut back off the file and what was
+ * buffered is kept for the next try, until close() gives up on it. The
+ * size of a file open for writing is tracked in process, so fileSize()
+ * doesn't stat it. Listing, directories and symlinks are StdFile's.
+ */
+class PosixFile : public StdFile {
+ public:
+  PosixFile(const std::string& name, bool framed);
+  virtual ~PosixFile();
+
+  bool openRead();
+  bool openWrite();
+  bool openTruncate();
+  bool isOpen();
+  void close();
+  bool write(const std::string& data);
+  bool writev(const struct iovec* iov, int iovcnt);
+  bool flush();
+  bool sync();
+  unsigned long fileSize();
+  long readNext(std::string& _return);
+  void deleteFile();
+  void setBufferSize(unsigned long size);
+  void setFadvise(bool fadvise);
+
+ protected:
+  bool open(int flags);
+
+  int fd;
+  bool reading;
+  unsigned long size;       // written to fd, plus what is buffered
+  unsigned long bufferSize;
+
+ private:
+  bool allocateBuffer();
+  bool writeOut(const struct iovec* iov, int iovcnt);
+  bool flushBuffer();
+  bool fill(unsigned long wanted);
+
+  bool fadvise;
+
+  // buffered writes, or read ahead data from bufferStart to bufferEnd
+  char* buffer;
+  unsigned long bufferStart;
+  unsigned long bufferEnd;
+  unsigned long readOffset; // bytes read from the file so far
+
+  // disallow copy, assignment, and empty construction
+  PosixFile();
+  PosixFile(PosixFile& rhs);
+  PosixFile& operator=(PosixFile& rhs);
+};
+
 #endif // !defined SCRIBE_FILE_H
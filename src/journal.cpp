@@ -0,0 +1,403 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include "common.h"
+#include "journal.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+using namespace std;
+using namespace scribe::thrift;
+using boost::shared_ptr;
+
+#define JOURNAL_HEADER "scribe journal "
+
+static void putUInt(string& buffer, uint32_t value) {
+  value = htonl(value);
+  buffer.append((const char*)&value, sizeof(value));
+}
+
+// Reads a length or count at offset, or returns false if there isn't one
+static bool getUInt(const string& buffer, size_t& offset, uint32_t& value) {
+  if (buffer.size() - offset < sizeof(value)) {
+    return false;
+  }
+  memcpy(&value, buffer.data() + offset, sizeof(value));
+  value = ntohl(value);
+  offset += sizeof(value);
+  return true;
+}
+
+static bool getString(const string& buffer, size_t& offset, string& value) {
+  uint32_t size;
+  if (!getUInt(buffer, offset, size) || buffer.size() - offset < size) {
+    return false;
+  }
+  value.assign(buffer, offset, size);
+  offset += size;
+  return true;
+}
+
+static void encodeEntry(string& record, const LogEntry& entry) {
+  putUInt(record, entry.category.size());
+  record += entry.category;
+  putUInt(record, entry.message.size());
+  record += entry.message;
+}
+
+// fills in the length of a record encoded after a placeholder
+static void finishRecord(string& record) {
+  uint32_t length = htonl(record.size() - sizeof(length));
+  record.replace(0, sizeof(length), (const char*)&length, sizeof(length));
+}
+
+Journal::Journal(const string& path_, const string& name_)
+  : path(path_),
+    name(name_),
+    active(0),
+    writing(-1) {
+  for (int i = 0; i < 2; ++i) {
+    segments[i].fd = -1;
+    segments[i].generation = 0;
+    segments[i].used = false;
+    segments[i].dirty = false;
+  }
+  pthread_mutex_init(&mutex, NULL);
+}
+
+Journal::~Journal() {
+  for (int i = 0; i < 2; ++i) {
+    if (segments[i].fd >= 0) {
+      ::close(segments[i].fd);
+    }
+  }
+  pthread_mutex_destroy(&mutex);
+}
+
+string Journal::segmentName(int index) const {
+  ostringstream filename;
+  filename << path << "/" << name << "." << index;
+  return filename.str();
+}
+
+bool Journal::open(logentry_vector_t& messages) {
+  try {
+    boost::filesystem::create_directories(path);
+  } catch (const std::exception& e) {
+    LOG_OPER("exception <%s> creating journal directory <%s>",
+             e.what(), path.c_str());
+    return false;
+  }
+
+  logentry_vector_t found[2];
+  for (int i = 0; i < 2; ++i) {
+    if (!openSegment(i, found[i])) {
+      return false;
+    }
+  }
+
+  // the newer segment stays active, and a previous run only ever left
+  // one of them free
+  int older = segments[0].generation < segments[1].generation ? 0 : 1;
+  if (!segments[older].used) {
+    older = 1 - older;
+  }
+  if (segments[older].used) {
+    messages.insert(messages.end(), found[older].begin(), found[older].end());
+  }
+  if (segments[1 - older].used) {
+    messages.insert(messages.end(), found[1 - older].begin(),
+                    found[1 - older].end());
+    active = 1 - older;
+  } else if (segments[older].used) {
+    active = older;
+  } else {
+    active = 0;
+    segments[0].generation = 1;
+  }
+  return true;
+}
+
+// Opens segment index and reads back its records. A segment without
+// any is truncated so that it is free, and one that ends in a partial
+// record is truncated after the last whole one.
+bool Journal::openSegment(int index, logentry_vector_t& messages) {
+  string filename = segmentName(index);
+  segment_t& segment = segments[index];
+  segment.fd = ::open(filename.c_str(),
+                      O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (segment.fd < 0) {
+    LOG_OPER("failed to open journal <%s>: %s",
+             filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(segment.fd, &info) != 0) {
+    LOG_OPER("failed to stat journal <%s>: %s",
+             filename.c_str(), strerror(errno));
+    return false;
+  }
+  string contents(info.st_size, '\0');
+  size_t done = 0;
+  while (done < contents.size()) {
+    ssize_t got = pread(segment.fd, &contents[done],
+                        contents.size() - done, done);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      LOG_OPER("failed to read journal <%s>: %s",
+               filename.c_str(), got < 0 ? strerror(errno) : "end of file");
+      return false;
+    }
+    done += got;
+  }
+
+  size_t header_end = contents.find('\n');
+  if (header_end == string::npos ||
+      contents.compare(0, strlen(JOURNAL_HEADER), JOURNAL_HEADER) != 0) {
+    if (!contents.empty()) {
+      LOG_OPER("dropping journal <%s> without a header", filename.c_str());
+    }
+    truncateSegment(index);
+    return true;
+  }
+  segment.generation = strtoul(contents.c_str() + strlen(JOURNAL_HEADER),
+                               NULL, 10);
+
+  size_t offset = header_end + 1;
+  size_t valid = offset;
+  size_t count_read = 0;
+  while (offset < contents.size()) {
+    uint32_t length;
+    uint32_t count;
+    if (!getUInt(contents, offset, length) ||
+        contents.size() - offset < length) {
+      break;
+    }
+    size_t end = offset + length;
+    if (!getUInt(contents, offset, count)) {
+      break;
+    }
+
+    size_t first = messages.size();
+    while (messages.size() - first < count && offset < end) {
+      shared_ptr<LogEntry> entry(new LogEntry);
+      if (!getString(contents, offset, entry->category) ||
+          !getString(contents, offset, entry->message)) {
+        break;
+      }
+      messages.push_back(entry);
+    }
+    if (messages.size() - first != count || offset != end) {
+      messages.resize(first);
+      break;
+    }
+    count_read += count;
+    valid = offset;
+  }
+
+  if (valid < contents.size()) {
+    LOG_OPER("dropping <%lu> bytes of partial record at the end of "
+             "journal <%s>", (unsigned long)(contents.size() - valid),
+             filename.c_str());
+    if (ftruncate(segment.fd, valid) != 0) {
+      LOG_OPER("failed to truncate journal <%s>: %s",
+               filename.c_str(), strerror(errno));
+      return false;
+    }
+  }
+
+  if (count_read == 0) {
+    truncateSegment(index);
+  } else {
+    LOG_OPER("read back <%lu> messages from journal <%s>",
+             (unsigned long)count_read, filename.c_str());
+    segment.used = true;
+  }
+  return true;
+}
+
+// Starts a free segment, the first time it is written to
+bool Journal::writeHeader(int index, unsigned long generation) {
+  ostringstream header;
+  header << JOURNAL_HEADER << generation << "\n";
+  vector<string> records(1, header.str());
+  return writeRecords(segments[index].fd, records);
+}
+
+void Journal::truncateSegment(int index) {
+  if (ftruncate(segments[index].fd, 0) != 0) {
+    LOG_OPER("failed to truncate journal <%s>: %s",
+             segmentName(index).c_str(), strerror(errno));
+  }
+  segments[index].used = false;
+  segments[index].dirty = false;
+}
+
+void Journal::encode(string& record, const logentry_ptr_t& first,
+                     const logentry_vector_t& rest) {
+  record.assign(sizeof(uint32_t), '\0');
+  putUInt(record, 1 + rest.size());
+  encodeEntry(record, *first);
+  for (logentry_vector_t::const_iterator iter = rest.begin();
+       iter != rest.end();
+       ++iter) {
+    encodeEntry(record, **iter);
+  }
+  finishRecord(record);
+}
+
+void Journal::encode(string& record, const logentry_vector_t& entries) {
+  record.assign(sizeof(uint32_t), '\0');
+  putUInt(record, entries.size());
+  for (logentry_vector_t::const_iterator iter = entries.begin();
+       iter != entries.end();
+       ++iter) {
+    encodeEntry(record, **iter);
+  }
+  finishRecord(record);
+}
+
+void Journal::append(string& record) {
+  pthread_mutex_lock(&mutex);
+  pending.push_back(string());
+  pending.back().swap(record);
+  if (writing >= 0) {
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+
+  // Write whatever has been queued, including what other threads queue
+  // while we are writing
+  while (!pending.empty()) {
+    int index = active;
+    writing = index;
+    written.swap(pending);
+    bool start = !segments[index].used;
+    unsigned long generation = segments[index].generation;
+    segments[index].used = true;
+    pthread_mutex_unlock(&mutex);
+
+    bool ok = (!start || writeHeader(index, generation)) &&
+              writeRecords(segments[index].fd, written);
+    if (!ok) {
+      // the messages are still in memory, they just won't survive a crash
+      LOG_OPER("failed to write <%lu> records to journal <%s>: %s",
+               (unsigned long)written.size(), segmentName(index).c_str(),
+               strerror(errno));
+    }
+    written.clear();
+
+    pthread_mutex_lock(&mutex);
+    if (ok) {
+      segments[index].dirty = true;
+    }
+  }
+  writing = -1;
+  pthread_mutex_unlock(&mutex);
+}
+
+// Writes records with as few writev() calls as possible
+bool Journal::writeRecords(int fd, vector<string>& records) {
+  struct iovec iov[IOV_MAX];
+  size_t next = 0;    // first record not completely written
+  size_t offset = 0;  // bytes of it already written
+  while (next < records.size()) {
+    int count = 0;
+    for (size_t i = next; i < records.size() && count < IOV_MAX; ++i) {
+      size_t skip = (i == next) ? offset : 0;
+      iov[count].iov_base = (void*)(records[i].data() + skip);
+      iov[count].iov_len = records[i].size() - skip;
+      ++count;
+    }
+
+    ssize_t done = writev(fd, iov, count);
+    if (done < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    size_t left = done;
+    while (next < records.size() && left >= records[next].size() - offset) {
+      left -= records[next].size() - offset;
+      offset = 0;
+      ++next;
+    }
+    offset += left;
+  }
+  return true;
+}
+
+bool Journal::seal() {
+  bool sealed = false;
+  pthread_mutex_lock(&mutex);
+  int other = 1 - active;
+  if (segments[active].used && !segments[other].used) {
+    segments[other].generation = segments[active].generation + 1;
+    active = other;
+    sealed = true;
+  }
+  pthread_mutex_unlock(&mutex);
+  return sealed;
+}
+
+void Journal::release() {
+  pthread_mutex_lock(&mutex);
+  // A write queued before seal() may still be going to the sealed
+  // segment, leave it for next time rather than truncate under it.
+  int sealed = 1 - active;
+  if (segments[sealed].used && writing != sealed) {
+    truncateSegment(sealed);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void Journal::reset() {
+  pthread_mutex_lock(&mutex);
+  truncateSegment(0);
+  truncateSegment(1);
+  pthread_mutex_unlock(&mutex);
+}
+
+void Journal::sync() {
+  int fds[2];
+  int count = 0;
+  pthread_mutex_lock(&mutex);
+  for (int i = 0; i < 2; ++i) {
+    if (segments[i].dirty) {
+      segments[i].dirty = false;
+      fds[count++] = segments[i].fd;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+
+  for (int i = 0; i < count; ++i) {
+    if (fdatasync(fds[i]) != 0) {
+      LOG_OPER("failed to sync journal <%s/%s>: %s",
+               path.c_str(), name.c_str(), strerror(errno));
+    }
+  }
+}
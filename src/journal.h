@@ -0,0 +1,114 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_JOURNAL_H
+#define SCRIBE_JOURNAL_H
+
+#include "common.h"
+
+/*
+ * Write-ahead journal of the messages a StoreQueue holds in memory, so
+ * that they can be replayed after a crash.
+ *
+ * Log() threads encode a record per batch and append() it. Whichever
+ * thread finds no write in progress writes every record queued so far
+ * with a single writev(), so concurrent appends are committed together
+ * and the file only ever sees large sequential writes. fdatasync() is
+ * left to sync(), which the store thread calls every
+ * journal_sync_interval_ms.
+ *
+ * The journal is kept in two segment files, <name>.0 and <name>.1, each
+ * starting with a generation number once written to, so that a segment
+ * that holds nothing is an empty file. Appends go to the active segment.
+ * seal() makes the other segment active if it is free, and release()
+ * truncates the sealed segment once everything appended to it has been
+ * handled, so the files don't grow while the store keeps up.
+ *
+ * A record is a 4 byte length followed by a 4 byte message count and,
+ * for each message, the length and bytes of its category and of the
+ * message, all lengths in network byte order. A record cut short by a
+ * crash is dropped when the journal is opened.
+ */
+class Journal {
+ public:
+  Journal(const std::string& path, const std::string& name);
+  ~Journal();
+
+  // Opens the segments and adds the messages a previous run left in them
+  // to messages, oldest first. Returns false if the journal can't be used.
+  bool open(logentry_vector_t& messages);
+
+  // Encode messages as a record for append()
+  static void encode(std::string& record, const logentry_ptr_t& first,
+                     const logentry_vector_t& rest);
+  static void encode(std::string& record, const logentry_vector_t& entries);
+
+  // Queues record to be written and leaves it empty. If another thread
+  // is already writing, it writes this record too and append() returns
+  // right away, otherwise this thread writes everything queued.
+  void append(std::string& record);
+
+  // Called by the store thread before taking queued messages. Makes the
+  // other segment active if it is free and returns true if it did, in
+  // which case the sealed segment only holds batches queued before the
+  // call.
+  bool seal();
+
+  // Called by the store thread once every batch in the sealed segment is
+  // handled
+  void release();
+
+  // Truncates both segments, once nothing will be appended
+  void reset();
+
+  // fdatasync()s the segments written since the last call
+  void sync();
+
+ private:
+  struct segment_t {
+    int fd;
+    unsigned long generation;
+    bool used;   // written to since it was last truncated
+    bool dirty;  // written since the last sync
+  };
+
+  bool openSegment(int index, logentry_vector_t& messages);
+  bool writeHeader(int index, unsigned long generation);
+  void truncateSegment(int index);
+  bool writeRecords(int fd, std::vector<std::string>& records);
+  std::string segmentName(int index) const;
+
+  std::string path;
+  std::string name;
+  segment_t segments[2];
+  int active;
+
+  // Records queued by append() and not written yet. writing is the
+  // segment a thread is writing them to, which it does without holding
+  // mutex, or -1.
+  std::vector<std::string> pending;
+  std::vector<std::string> written;
+  int writing;
+  pthread_mutex_t mutex;
+
+  // disallow copy and assignment
+  Journal(const Journal& rhs);
+  const Journal& operator=(const Journal& rhs);
+};
+
+#endif // SCRIBE_JOURNAL_H
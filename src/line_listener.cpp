@@ -0,0 +1,380 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "scribe_server.h"
+#include "line_listener.h"
+
+using namespace std;
+using namespace scribe::thrift;
+
+#define DEFAULT_LINE_MAX_LENGTH (1024 * 1024)
+#define READ_BUFFER_SIZE        65536
+#define MAX_DATAGRAMS_PER_READ  64
+#define RETRY_INTERVAL_MSEC     100
+
+typedef void (*event_callback_t)(int, short, void*);
+
+static void* lineListenerStatic(void *this_ptr) {
+  static_cast<LineListener*>(this_ptr)->threadMember();
+  return NULL;
+}
+
+static void setNonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    throw runtime_error("LineListener: failed to make socket nonblocking");
+  }
+}
+
+// Binds a TCP or UDP socket, preferring ipv6 like listenSocket()
+static int bindInetSocket(const string& ip, unsigned long port, int socktype) {
+  struct addrinfo hints, *res, *res0;
+  char port_str[sizeof("65536") + 1];
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = socktype;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+  sprintf(port_str, "%lu", port);
+
+  int error = getaddrinfo(ip.empty() ? NULL : ip.c_str(), port_str,
+                          &hints, &res0);
+  if (error) {
+    throw runtime_error(string("LineListener: getaddrinfo ") +
+                        gai_strerror(error));
+  }
+
+  for (res = res0; res; res = res->ai_next) {
+    if (res->ai_family == AF_INET6 || res->ai_next == NULL)
+      break;
+  }
+
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd == -1) {
+    freeaddrinfo(res0);
+    throw runtime_error("LineListener: socket() failed");
+  }
+
+  #ifdef IPV6_V6ONLY
+  if (res->ai_family == AF_INET6) {
+    int zero = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  }
+  #endif // #ifdef IPV6_V6ONLY
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+    close(fd);
+    freeaddrinfo(res0);
+    ostringstream msg;
+    msg << "LineListener: bind to port " << port << " failed";
+    throw runtime_error(msg.str());
+  }
+  freeaddrinfo(res0);
+
+  setNonblocking(fd);
+  return fd;
+}
+
+static int bindUnixSocket(const string& path) {
+  struct sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw runtime_error("LineListener: line_socket path is too long");
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    throw runtime_error("LineListener: socket() failed");
+  }
+
+  // remove a socket left behind by a previous run, but nothing else that
+  // happens to be in the way
+  struct stat info;
+  if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(path.c_str());
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    throw runtime_error("LineListener: bind to " + path + " failed");
+  }
+
+  setNonblocking(fd);
+  return fd;
+}
+
+LineListener::LineListener()
+  : tcpPort(0),
+    udpPort(0),
+    maxLineLength(DEFAULT_LINE_MAX_LENGTH),
+    eventBase(NULL),
+    readBuffer(READ_BUFFER_SIZE) {
+}
+
+LineListener::~LineListener() {
+  for (size_t i = 0; i < listenEvents.size(); ++i) {
+    event_del(listenEvents[i]);
+    delete listenEvents[i];
+  }
+  for (size_t i = 0; i < listenFds.size(); ++i) {
+    close(listenFds[i]);
+  }
+  if (!unixPath.empty()) {
+    unlink(unixPath.c_str());
+  }
+}
+
+bool LineListener::configure(const StoreConf& config, const string& ip_) {
+  ip = ip_;
+  config.getUnsigned("line_port", tcpPort);
+  config.getString("line_socket", unixPath);
+  config.getUnsigned("udp_port", udpPort);
+  config.getUnsigned("line_max_length", maxLineLength);
+
+  return tcpPort != 0 || !unixPath.empty() || udpPort != 0;
+}
+
+void LineListener::start() {
+  eventBase = event_base_new();
+
+  vector<pair<int, event_callback_t> > sockets;
+  if (tcpPort != 0) {
+    int fd = bindInetSocket(ip, tcpPort, SOCK_STREAM);
+    listen(fd, 1024);
+    sockets.push_back(make_pair(fd, &LineListener::acceptCallback));
+    LOG_OPER("Listening for line protocol on port %lu", tcpPort);
+  }
+  if (!unixPath.empty()) {
+    int fd = bindUnixSocket(unixPath);
+    listen(fd, 1024);
+    sockets.push_back(make_pair(fd, &LineListener::acceptCallback));
+    LOG_OPER("Listening for line protocol on <%s>", unixPath.c_str());
+  }
+  if (udpPort != 0) {
+    int fd = bindInetSocket(ip, udpPort, SOCK_DGRAM);
+    sockets.push_back(make_pair(fd, &LineListener::datagramCallback));
+    LOG_OPER("Listening for line protocol datagrams on port %lu", udpPort);
+  }
+
+  for (size_t i = 0; i < sockets.size(); ++i) {
+    struct event* ev = new struct event;
+    event_set(ev, sockets[i].first, EV_READ | EV_PERSIST,
+              sockets[i].second, this);
+    event_base_set(eventBase, ev);
+    event_add(ev, NULL);
+    listenEvents.push_back(ev);
+    listenFds.push_back(sockets[i].first);
+  }
+
+  if (pthread_create(&thread, NULL, lineListenerStatic, this) != 0) {
+    throw runtime_error("LineListener: failed to create thread");
+  }
+}
+
+void LineListener::threadMember() {
+  event_base_loop(eventBase, 0);
+}
+
+void LineListener::acceptCallback(int fd, short which, void *arg) {
+  static_cast<LineListener*>(arg)->acceptConnection(fd);
+}
+
+void LineListener::readCallback(int fd, short which, void *arg) {
+  connection_t* conn = static_cast<connection_t*>(arg);
+  conn->listener->readConnection(conn);
+}
+
+void LineListener::retryCallback(int fd, short which, void *arg) {
+  connection_t* conn = static_cast<connection_t*>(arg);
+  conn->listener->retryConnection(conn);
+}
+
+void LineListener::datagramCallback(int fd, short which, void *arg) {
+  static_cast<LineListener*>(arg)->readDatagrams(fd);
+}
+
+void LineListener::acceptConnection(int listen_fd) {
+  int fd;
+  while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+    try {
+      setNonblocking(fd);
+    } catch(const std::exception& e) {
+      LOG_OPER("%s", e.what());
+      close(fd);
+      continue;
+    }
+
+    connection_t* conn = new connection_t;
+    conn->fd = fd;
+    conn->eof = false;
+    conn->listener = this;
+
+    event_set(&conn->readEvent, fd, EV_READ | EV_PERSIST,
+              &LineListener::readCallback, conn);
+    event_base_set(eventBase, &conn->readEvent);
+    evtimer_set(&conn->retryEvent, &LineListener::retryCallback, conn);
+    event_base_set(eventBase, &conn->retryEvent);
+    event_add(&conn->readEvent, NULL);
+  }
+}
+
+void LineListener::readConnection(connection_t* conn) {
+  ssize_t got = read(conn->fd, &readBuffer[0], readBuffer.size());
+  if (got < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      closeConnection(conn);
+    }
+    return;
+  }
+
+  if (got == 0) {
+    // the last line doesn't need a newline
+    if (!conn->buffer.empty()) {
+      parseLine(conn->buffer.data(), conn->buffer.size(), conn->pending);
+      conn->buffer.clear();
+    }
+    conn->eof = true;
+  } else {
+    conn->buffer.append(&readBuffer[0], got);
+    size_t used = parseLines(conn->buffer.data(), conn->buffer.size(),
+                             conn->pending);
+    conn->buffer.erase(0, used);
+
+    if (conn->buffer.size() > maxLineLength) {
+      LOG_OPER("LineListener: closing connection with a line over <%lu> bytes",
+               maxLineLength);
+      g_Handler->incCounter("line too long");
+      closeConnection(conn);
+      return;
+    }
+  }
+
+  if (sendPending(conn)) {
+    if (conn->eof) {
+      closeConnection(conn);
+    }
+  } else {
+    // stop reading until the messages we have are accepted
+    event_del(&conn->readEvent);
+    struct timeval retry = {0, RETRY_INTERVAL_MSEC * 1000};
+    evtimer_add(&conn->retryEvent, &retry);
+  }
+}
+
+void LineListener::retryConnection(connection_t* conn) {
+  if (!sendPending(conn)) {
+    struct timeval retry = {0, RETRY_INTERVAL_MSEC * 1000};
+    evtimer_add(&conn->retryEvent, &retry);
+  } else if (conn->eof) {
+    closeConnection(conn);
+  } else {
+    event_add(&conn->readEvent, NULL);
+  }
+}
+
+bool LineListener::sendPending(connection_t* conn) {
+  if (conn->pending.empty()) {
+    return true;
+  }
+  if (g_Handler->Log(conn->pending) != OK) {
+    return false;
+  }
+  conn->pending.clear();
+  return true;
+}
+
+void LineListener::closeConnection(connection_t* conn) {
+  event_del(&conn->readEvent);
+  event_del(&conn->retryEvent);
+  close(conn->fd);
+  delete conn;
+}
+
+void LineListener::readDatagrams(int fd) {
+  vector<LogEntry> messages;
+
+  for (int i = 0; i < MAX_DATAGRAMS_PER_READ; ++i) {
+    ssize_t got = recv(fd, &readBuffer[0], readBuffer.size(), 0);
+    if (got <= 0) {
+      break;
+    }
+
+    // a datagram always ends a line
+    size_t used = parseLines(&readBuffer[0], got, messages);
+    if (used < (size_t)got) {
+      parseLine(&readBuffer[used], got - used, messages);
+    }
+  }
+
+  if (!messages.empty() && g_Handler->Log(messages) != OK) {
+    g_Handler->incCounter("udp dropped", messages.size());
+  }
+}
+
+size_t LineListener::parseLines(const char* data, size_t length,
+                                vector<LogEntry>& messages) {
+  size_t start = 0;
+  while (start < length) {
+    const char* newline = static_cast<const char*>(
+      memchr(data + start, '\n', length - start));
+    if (newline == NULL) {
+      break;
+    }
+    size_t end = newline - data + 1;
+    parseLine(data + start, end - start, messages);
+    start = end;
+  }
+  return start;
+}
+
+void LineListener::parseLine(const char* line, size_t length,
+                             vector<LogEntry>& messages) {
+  // the newline doesn't count, as for a line that is still being read
+  size_t line_length = length;
+  if (line_length > 0 && line[line_length - 1] == '\n') {
+    --line_length;
+  }
+  if (line_length > maxLineLength) {
+    g_Handler->incCounter("line too long");
+    return;
+  }
+
+  messages.push_back(LogEntry());
+  LogEntry& entry = messages.back();
+
+  const char* tab = static_cast<const char*>(memchr(line, '\t', length));
+  if (tab == NULL) {
+    // Log() counts these as blank categories
+    entry.message.assign(line, length);
+  } else {
+    entry.category.assign(line, tab - line);
+    entry.message.assign(tab + 1, length - (tab - line) - 1);
+  }
+}
@@ -0,0 +1,102 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_LINE_LISTENER_H
+#define SCRIBE_LINE_LISTENER_H
+
+#include "common.h"
+#include "conf.h"
+
+/*
+ * Optional listeners for producers that can't easily speak Thrift.
+ * Every line is "<category>\t<message>\n". Lines are parsed in batches and
+ * passed to scribeHandler::Log(), so they go through the same throttling,
+ * routing and counters as Thrift messages. The newline stays part of the
+ * message, like scribe_cat. Lines without a tab have a blank category.
+ *
+ * Configured in the global section of scribe.conf:
+ *   line_port        - TCP port for newline delimited streams
+ *   line_socket      - path of a Unix domain socket for the same
+ *   udp_port         - UDP port, a datagram holds one or more lines
+ *   line_max_length  - longest line accepted, in bytes (default 1MB)
+ *
+ * Longer lines are dropped and counted in "line too long". A stream that
+ * sends more than that without a newline is closed, since it isn't known
+ * where its line ends.
+ *
+ * All listeners share one thread with its own event loop. A stream that
+ * gets TRY_LATER is not read until its messages have been accepted.
+ * Datagrams that get TRY_LATER are dropped and counted in "udp dropped".
+ */
+class LineListener {
+ public:
+  LineListener();
+  virtual ~LineListener();
+
+  // Returns false if no listener is configured
+  bool configure(const StoreConf& config, const std::string& ip);
+  void start();
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+ private:
+  struct connection_t {
+    int fd;
+    std::string buffer; // data read after the last complete line
+    std::vector<scribe::thrift::LogEntry> pending; // got TRY_LATER
+    bool eof;           // the client is done, close after pending is sent
+    struct event readEvent;
+    struct event retryEvent;
+    LineListener* listener;
+  };
+
+  static void acceptCallback(int fd, short which, void *arg);
+  static void readCallback(int fd, short which, void *arg);
+  static void retryCallback(int fd, short which, void *arg);
+  static void datagramCallback(int fd, short which, void *arg);
+
+  void acceptConnection(int listen_fd);
+  void readConnection(connection_t* conn);
+  void retryConnection(connection_t* conn);
+  bool sendPending(connection_t* conn);
+  void closeConnection(connection_t* conn);
+  void readDatagrams(int fd);
+
+  // appends complete lines from data to messages and returns the number
+  // of bytes used
+  size_t parseLines(const char* data, size_t length,
+                    std::vector<scribe::thrift::LogEntry>& messages);
+  void parseLine(const char* line, size_t length,
+                 std::vector<scribe::thrift::LogEntry>& messages);
+
+  unsigned long tcpPort;
+  std::string unixPath;
+  unsigned long udpPort;
+  unsigned long maxLineLength;
+  std::string ip;
+
+  struct event_base* eventBase;
+  std::vector<struct event*> listenEvents;
+  std::vector<int> listenFds;
+  std::vector<char> readBuffer;
+  pthread_t thread;
+};
+
+#endif // SCRIBE_LINE_LISTENER_H
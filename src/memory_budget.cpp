@@ -0,0 +1,116 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include "common.h"
+#include "memory_budget.h"
+
+using namespace std;
+
+MemoryBudget::MemoryBudget()
+  : limit(0),
+    used(0),
+    reserved(0),
+    reservedUsed(0),
+    numSharing(0) {
+}
+
+void MemoryBudget::configure(unsigned long long new_limit) {
+  limit = new_limit;
+}
+
+bool MemoryBudget::admit(const MemoryAccount& account,
+                         unsigned long long bytes) const {
+  if (!isLimited()) {
+    return true;
+  }
+
+  long long before = account.used;
+  long long after = before + (long long)bytes;
+  long long reservation = account.reservation;
+  if (after <= reservation) {
+    return true;
+  }
+
+  // what this takes from the shared pool
+  long long shared_pool = (long long)limit - reserved;
+  long long shared_used = used - reservedUsed;
+  long long shared_bytes = after - max(before, reservation);
+  if (shared_used + shared_bytes > shared_pool) {
+    return false;
+  }
+
+  if (shared_used * 2 > shared_pool) {
+    long sharing = numSharing + (before > reservation ? 0 : 1);
+    if (after - reservation > shared_pool / sharing) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+MemoryAccount::MemoryAccount(MemoryBudget& budget_)
+  : budget(budget_),
+    used(0),
+    reservation(0) {
+}
+
+MemoryAccount::~MemoryAccount() {
+  clear();
+}
+
+void MemoryAccount::clear() {
+  if (reservation != 0) {
+    setReservation(0);
+  }
+  add(-used);
+}
+
+void MemoryAccount::setReservation(unsigned long long new_reservation) {
+  // Take this account out of the budget's counts, change the reservation,
+  // and put it back. Reservations are only changed while configuring,
+  // before messages are added, so used doesn't change in between.
+  long long current = used;
+  update(current, 0);
+  __sync_add_and_fetch(&budget.reserved,
+                       (long long)new_reservation - reservation);
+  reservation = new_reservation;
+  update(0, current);
+}
+
+void MemoryAccount::add(long long bytes) {
+  if (bytes == 0) {
+    return;
+  }
+  long long after = __sync_add_and_fetch(&used, bytes);
+  update(after - bytes, after);
+  __sync_add_and_fetch(&budget.used, bytes);
+}
+
+void MemoryAccount::update(long long before, long long after) {
+  long long reserved_delta = min(after, reservation) -
+                             min(before, reservation);
+  if (reserved_delta != 0) {
+    __sync_add_and_fetch(&budget.reservedUsed, reserved_delta);
+  }
+  if (before <= reservation && after > reservation) {
+    __sync_add_and_fetch(&budget.numSharing, 1);
+  } else if (before > reservation && after <= reservation) {
+    __sync_sub_and_fetch(&budget.numSharing, 1);
+  }
+}
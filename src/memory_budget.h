@@ -0,0 +1,145 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_MEMORY_BUDGET_H
+#define SCRIBE_MEMORY_BUDGET_H
+
+#include "common.h"
+
+class MemoryAccount;
+
+/*
+ * Process wide count of the bytes of messages held in memory by all
+ * StoreQueues, see max_total_queue_size. Each StoreQueue has a
+ * MemoryAccount, which can reserve part of the limit for its category
+ * (reserved_queue_size). The rest is a pool shared by all categories.
+ * Once the shared pool is more than half full, a category is also held
+ * to an equal share of it, so that one backlogged category can't take
+ * all of it from the others.
+ * A limit of 0 means unlimited. All counts are updated with atomic adds,
+ * so admit() is a snapshot like StoreQueue::getSize().
+ */
+class MemoryBudget {
+ public:
+  MemoryBudget();
+
+  void configure(unsigned long long limit);
+
+  // Whether account can take bytes more without going over its share
+  bool admit(const MemoryAccount& account, unsigned long long bytes) const;
+
+  inline bool isLimited() const {
+    return limit != 0;
+  }
+  inline unsigned long long getLimit() const {
+    return limit;
+  }
+  inline long long getUsed() const {
+    return used;
+  }
+  inline long long getReserved() const {
+    return reserved;
+  }
+
+ private:
+  friend class MemoryAccount;
+
+  volatile unsigned long long limit;
+  volatile long long used;         // bytes held by all accounts
+  volatile long long reserved;     // sum of all reservations
+  volatile long long reservedUsed; // part of used within reservations
+  volatile long numSharing;        // accounts over their reservation
+
+  // disallow copy and assignment
+  MemoryBudget(const MemoryBudget& rhs);
+  const MemoryBudget& operator=(const MemoryBudget& rhs);
+};
+
+/*
+ * Bytes held by one StoreQueue, counted against a MemoryBudget.
+ * Whatever is still held is given back by clear() or when the account is
+ * destroyed. A cleared account doesn't touch the budget when destroyed.
+ */
+class MemoryAccount {
+ public:
+  MemoryAccount(MemoryBudget& budget);
+  ~MemoryAccount();
+
+  // Amount of the budget only this account can use
+  void setReservation(unsigned long long reservation);
+
+  // bytes are negative when they are given back
+  void add(long long bytes);
+
+  // Gives back everything held and the reservation
+  void clear();
+
+  inline bool admit(unsigned long long bytes) const {
+    return budget.admit(*this, bytes);
+  }
+  inline long long getUsed() const {
+    return used;
+  }
+  inline long long getReservation() const {
+    return reservation;
+  }
+
+ private:
+  friend class MemoryBudget;
+
+  // adds to the budget's counts what this account's used going from
+  // before to after changes in them
+  void update(long long before, long long after);
+
+  MemoryBudget& budget;
+  volatile long long used;
+  long long reservation;
+
+  // disallow copy and assignment
+  MemoryAccount(const MemoryAccount& rhs);
+  const MemoryAccount& operator=(const MemoryAccount& rhs);
+};
+
+/*
+ * Charges bytes to an account for as long as it is in scope, for batches
+ * that are only held while a call is in progress.
+ */
+class MemoryCharge {
+ public:
+  MemoryCharge(MemoryAccount* account_, long long bytes_)
+    : account(account_), bytes(bytes_) {
+    if (account) {
+      account->add(bytes);
+    }
+  }
+  ~MemoryCharge() {
+    if (account) {
+      account->add(-bytes);
+    }
+  }
+
+ private:
+  MemoryAccount* account;
+  long long bytes;
+
+  // disallow copy and assignment
+  MemoryCharge(const MemoryCharge& rhs);
+  const MemoryCharge& operator=(const MemoryCharge& rhs);
+};
+
+#endif // SCRIBE_MEMORY_BUDGET_H
@@ -0,0 +1,163 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include "common.h"
+#include "scribe_server.h"
+#include "rate_limiter.h"
+
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::transport;
+
+using boost::shared_ptr;
+
+// set by processContext() right before a call is processed by this thread,
+// points at the connection's context
+static __thread shared_ptr<TokenBucket>* currentConnection = NULL;
+
+TokenBucket::TokenBucket()
+  : rate(0),
+    burst(0),
+    capacity(0),
+    milliTokens(0),
+    lastRefill(0) {
+}
+
+TokenBucket::TokenBucket(unsigned long rate, unsigned long burst)
+  : rate(0),
+    burst(0),
+    capacity(0),
+    milliTokens(0),
+    lastRefill(0) {
+  configure(rate, burst);
+}
+
+void TokenBucket::configure(unsigned long new_rate, unsigned long new_burst) {
+  if (new_rate == 0) {
+    rate = 0;
+    return;
+  }
+  if (new_burst == 0) {
+    new_burst = new_rate;
+  }
+
+  // Start out full. rate is set last so that consume() doesn't look at the
+  // other fields before they are set.
+  burst = new_burst;
+  capacity = (long long)new_burst * 1000;
+  milliTokens = capacity;
+  lastRefill = scribe::clock::monotonicInMsec();
+  rate = new_rate;
+}
+
+bool TokenBucket::consume(unsigned long num_tokens) {
+  if (!isLimited()) {
+    return true;
+  }
+
+  refill();
+
+  long long needed = cost(num_tokens);
+  long long current = milliTokens;
+  while (current >= needed) {
+    long long prev = __sync_val_compare_and_swap(&milliTokens, current,
+                                                 current - needed);
+    if (prev == current) {
+      return true;
+    }
+    current = prev;
+  }
+  return false;
+}
+
+void TokenBucket::refund(unsigned long num_tokens) {
+  if (!isLimited()) {
+    return;
+  }
+  addMilliTokens(cost(num_tokens));
+}
+
+long long TokenBucket::cost(unsigned long num_tokens) const {
+  long long needed = (long long)num_tokens * 1000;
+  return needed > capacity ? capacity : needed;
+}
+
+void TokenBucket::refill() {
+  unsigned long now = scribe::clock::monotonicInMsec();
+  unsigned long last = lastRefill;
+  if (now <= last) {
+    return;
+  }
+
+  // Only the thread that moves lastRefill forward adds the tokens for
+  // that interval, everyone else goes on with what is in the bucket.
+  if (!__sync_bool_compare_and_swap(&lastRefill, last, now)) {
+    return;
+  }
+
+  // rate tokens per second is rate thousandths of a token per msec
+  unsigned long elapsed = now - last;
+  if (elapsed > (unsigned long)(capacity / rate)) {
+    addMilliTokens(capacity);
+  } else {
+    addMilliTokens((long long)elapsed * rate);
+  }
+}
+
+void TokenBucket::addMilliTokens(long long amount) {
+  long long current = milliTokens;
+  while (current < capacity) {
+    long long next = current + amount;
+    if (next > capacity) {
+      next = capacity;
+    }
+    long long prev = __sync_val_compare_and_swap(&milliTokens, current, next);
+    if (prev == current) {
+      return;
+    }
+    current = prev;
+  }
+}
+
+
+void* ConnectionRateLimiter::createContext(shared_ptr<TProtocol> input,
+                                           shared_ptr<TProtocol> output) {
+  unsigned long rate = g_Handler->getMaxConnMsgPerSecond();
+  if (rate == 0) {
+    return NULL;
+  }
+  return new shared_ptr<TokenBucket>(
+    new TokenBucket(rate, g_Handler->getMaxConnMsgBurst()));
+}
+
+void ConnectionRateLimiter::deleteContext(void* serverContext,
+                                          shared_ptr<TProtocol> input,
+                                          shared_ptr<TProtocol> output) {
+  delete static_cast<shared_ptr<TokenBucket>*>(serverContext);
+}
+
+void ConnectionRateLimiter::processContext(void* serverContext,
+                                           shared_ptr<TTransport> transport) {
+  currentConnection = static_cast<shared_ptr<TokenBucket>*>(serverContext);
+}
+
+shared_ptr<TokenBucket> ConnectionRateLimiter::getCurrentConnection() {
+  if (currentConnection) {
+    return *currentConnection;
+  }
+  return shared_ptr<TokenBucket>();
+}
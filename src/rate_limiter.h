@@ -0,0 +1,97 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_RATE_LIMITER_H
+#define SCRIBE_RATE_LIMITER_H
+
+#include "common.h"
+
+/*
+ * Lock-free token bucket used to throttle Log() calls.
+ * The bucket holds up to 'burst' tokens and is refilled at 'rate' tokens per
+ * second, in steps of a millisecond. Tokens are counted in thousandths so
+ * that no fraction of a token is lost between refills.
+ * A rate of 0 means unlimited.
+ */
+class TokenBucket {
+ public:
+  TokenBucket();
+  TokenBucket(unsigned long rate, unsigned long burst);
+
+  // burst defaults to one second's worth of tokens if 0
+  void configure(unsigned long rate, unsigned long burst);
+
+  // Takes num_tokens out of the bucket. Returns false and takes nothing if
+  // there aren't enough tokens. A request for more than the whole bucket
+  // is allowed once the bucket is full, otherwise it could never succeed.
+  bool consume(unsigned long num_tokens);
+
+  // Puts back tokens taken by consume(), e.g. when the request was denied
+  // by another bucket after this one allowed it.
+  void refund(unsigned long num_tokens);
+
+  inline bool isLimited() const {
+    return rate != 0;
+  }
+  inline unsigned long getRate() const {
+    return rate;
+  }
+  inline unsigned long getBurst() const {
+    return burst;
+  }
+
+ private:
+  void refill();
+  void addMilliTokens(long long amount);
+  long long cost(unsigned long num_tokens) const;
+
+  volatile unsigned long rate;       // tokens per second
+  volatile unsigned long burst;      // in tokens
+  volatile long long capacity;       // in thousandths of a token
+  volatile long long milliTokens;    // in thousandths of a token
+  volatile unsigned long lastRefill; // in msec, from scribe::clock::monotonicInMsec()
+};
+
+/*
+ * Gives every Thrift connection its own TokenBucket, configured from
+ * max_conn_msg_per_second and max_conn_msg_burst when the connection is
+ * accepted, so that a single noisy client can't use up the global budget.
+ * Buckets are shared, so that a LogAsync() batch can still refund its
+ * connection's bucket after the connection has closed.
+ * Needs a Thrift server that supports connection contexts; older servers
+ * never call these hooks and connections are simply not limited.
+ */
+class ConnectionRateLimiter : public apache::thrift::server::TServerEventHandler {
+ public:
+  void* createContext(
+    boost::shared_ptr<apache::thrift::protocol::TProtocol> input,
+    boost::shared_ptr<apache::thrift::protocol::TProtocol> output);
+  void deleteContext(
+    void* serverContext,
+    boost::shared_ptr<apache::thrift::protocol::TProtocol> input,
+    boost::shared_ptr<apache::thrift::protocol::TProtocol> output);
+  void processContext(
+    void* serverContext,
+    boost::shared_ptr<apache::thrift::transport::TTransport> transport);
+
+  // Bucket of the connection whose call is being processed by this thread,
+  // or NULL if connections are not limited.
+  static boost::shared_ptr<TokenBucket> getCurrentConnection();
+};
+
+#endif // SCRIBE_RATE_LIMITER_H
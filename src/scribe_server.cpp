@@ -36,15 +36,31 @@ using boost::shared_ptr;
 
 shared_ptr<scribeHandler> g_Handler;
 
-#define DEFAULT_CHECK_PERIOD       5
+#define DEFAULT_CHECK_PERIOD_MS    5000
 #define DEFAULT_MAX_MSG_PER_SECOND 0
 #define DEFAULT_MAX_QUEUE_SIZE     5000000LL
 #define DEFAULT_SERVER_THREADS     3
+#define DEFAULT_IO_THREADS         1
+#define DEFAULT_ASYNC_THREADS      0
+#define DEFAULT_ASYNC_QUEUE_SIZE   1024
 #define DEFAULT_MAX_CONN           0
 
 static string overall_category = "scribe_overall";
 static string log_separator = ":";
 
+// Histograms of the message pipeline in the order messages go through it,
+// summarized in counters over every second
+static const char* pipeline_stages[] = {
+  "async wait ms",
+  "queue wait ms",
+  "batch size",
+  "handle ms",
+  "flush ms",
+  "sync ms",
+  "replay ms",
+  "flush latency ms"
+};
+
 void print_usage(const char* program_name) {
   cout << "Usage: " << program_name << " [--ip x.x.x.x] [-p port] [-c config_file]" << endl;
 }
@@ -66,6 +82,44 @@ void scribeHandler::incCounter(string counter, long amount) {
   incrementCounter(overall_category + log_separator + counter, amount);
 }
 
+CounterHandle* scribeHandler::getCounterHandle(const string& category,
+                                               const string& counter) {
+  return counterRegistry.get(category + log_separator + counter,
+                             overall_category + log_separator + counter);
+}
+
+CounterHandle* scribeHandler::getCounterHandle(const string& counter) {
+  return counterRegistry.get("", overall_category + log_separator + counter);
+}
+
+LatencyHistogram* scribeHandler::getLatencyHistogram(const string& category,
+                                                    const string& name) {
+  return counterRegistry.getHistogram(category + log_separator + name,
+                                      overall_category + log_separator + name);
+}
+
+void scribeHandler::foldCounters() {
+  counterRegistry.fold(*this);
+  for (size_t i = 0;
+       i < sizeof(pipeline_stages) / sizeof(pipeline_stages[0]);
+       ++i) {
+    counterRegistry.summarize(
+      *this, overall_category + log_separator + pipeline_stages[i]);
+  }
+}
+
+// Make sure counts from handles show up when counters are read. The
+// summaries are left to foldCounters(), so that each covers a second.
+void scribeHandler::getCounters(map<string, int64_t>& _return) {
+  counterRegistry.fold(*this);
+  FacebookBase::getCounters(_return);
+}
+
+int64_t scribeHandler::getCounter(const string& key) {
+  counterRegistry.fold(*this);
+  return FacebookBase::getCounter(key);
+}
+
 int main(int argc, char **argv) {
 
   try {
@@ -140,17 +194,35 @@ scribeHandler::scribeHandler(const std::string& ip, unsigned long int server_por
     ip(ip),
     port(server_port),
     numThriftServerThreads(DEFAULT_SERVER_THREADS),
-    checkPeriod(DEFAULT_CHECK_PERIOD),
+    numIoThreads(DEFAULT_IO_THREADS),
+    numAsyncThreads(DEFAULT_ASYNC_THREADS),
+    checkPeriod(DEFAULT_CHECK_PERIOD_MS),
+    asyncQueueSize(DEFAULT_ASYNC_QUEUE_SIZE),
+    asyncBlockWhenFull(false),
     configFilename(config_file),
     status(STARTING),
     statusDetails("initial state"),
-    numMsgLastSecond(0),
-    maxMsgPerSecond(DEFAULT_MAX_MSG_PER_SECOND),
+    maxConnMsgPerSecond(0),
+    maxConnMsgBurst(0),
     maxConn(DEFAULT_MAX_CONN),
     maxQueueSize(DEFAULT_MAX_QUEUE_SIZE),
+    numOverloadedQueues(0),
     newThreadPerCategory(true) {
-  time(&lastMsgTime);
   scribeHandlerLock = scribe::concurrency::createReadWriteMutex();
+  routes = routing_table_t(new route_map_t);
+  for (int i = 0; i < NUM_PRIORITIES; ++i) {
+    numOverloadedByPriority[i] = 0;
+  }
+
+  receivedBlankCategory = getCounterHandle("received blank category");
+  deniedForRate = getCounterHandle("denied for rate");
+  deniedForConnectionRate = getCounterHandle("denied for connection rate");
+  tokensDenied = getCounterHandle("tokens denied");
+  asyncDropped = getCounterHandle("async dropped");
+  asyncHandoffs = getCounterHandle("async handoffs");
+  asyncHandoffUsec = getCounterHandle("async handoff usec");
+  asyncWait = counterRegistry.getHistogram(
+    "", overall_category + log_separator + "async wait ms");
 }
 
 scribeHandler::~scribeHandler() {
@@ -272,52 +344,172 @@ bool scribeHandler::createCategoryFromModel(
              category.c_str(), model->getCategoryHandled().c_str());
   }
 
+  // Published store lists are read without locks, so never modify one in
+  // place; copy it and replace the entry instead.
   shared_ptr<store_list_t> pstores;
   category_map_t::iterator cat_iter = categories.find(category);
   if (cat_iter == categories.end()) {
     pstores = shared_ptr<store_list_t>(new store_list_t);
-    categories[category] = pstores;
   } else {
-    pstores = cat_iter->second;
+    pstores = shared_ptr<store_list_t>(new store_list_t(*cat_iter->second));
   }
   pstores->push_back(pstore);
+  categories[category] = pstores;
 
   return true;
 }
 
+// Returns the current routing table. Callers that hold on to it delay
+// stopStores(), so drop the reference before blocking on scribeHandlerLock.
+routing_table_t scribeHandler::getRoutes() {
+  return boost::atomic_load(&routes);
+}
 
-// Check if we need to deny this request due to throttling
-bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
-  // Check if we need to rate limit
-  if (throttleDeny(messages.size())) {
-    incCounter("denied for rate");
-    return true;
-  }
-
-  // Throttle based on store queues getting too long.
-  // Note that there's one decision for all categories, because the whole array passed to us
-  // must either succeed or fail together. Checking before we've queued anything also has
-  // the nice property that any size array will succeed if we're unloaded before attempting
-  // it, so we won't hit a case where there's a client request that will never succeed.
-  // Also note that we always check all categories, not just the ones in this request.
-  // This is a simplification based on the assumption that most Log() calls contain most
-  // categories.
+// Publishes a copy of categories for Log() to use.
+// Should be called while holding a writeLock on scribeHandlerLock
+void scribeHandler::publishRoutes() {
+  shared_ptr<route_map_t> new_routes(new route_map_t);
   for (category_map_t::iterator cat_iter = categories.begin();
        cat_iter != categories.end();
        ++cat_iter) {
-    shared_ptr<store_list_t> pstores = cat_iter->second;
-    if (!pstores) {
-      throw std::logic_error("throttle check: iterator in category map holds null pointer");
+    route_t& route = (*new_routes)[cat_iter->first];
+    route.stores = cat_iter->second;
+    route.counters = getCategoryCounters(cat_iter->first);
+  }
+  boost::atomic_store(&routes, routing_table_t(new_routes));
+}
+
+// Should be called while holding a writeLock on scribeHandlerLock
+const category_counters_t* scribeHandler::getCategoryCounters(
+  const string& category) {
+
+  map<string, category_counters_t>::iterator iter =
+    categoryCounters.find(category);
+  if (iter == categoryCounters.end()) {
+    category_counters_t counters;
+    counters.receivedGood = getCounterHandle(category, "received good");
+    counters.receivedBad = getCounterHandle(category, "received bad");
+    counters.deniedForRate = getCounterHandle(category, "denied for rate");
+    counters.tokensDenied = getCounterHandle(category, "tokens denied");
+    counters.deniedForMemory = getCounterHandle(category,
+                                                "denied for memory");
+    iter = categoryCounters.insert(make_pair(category, counters)).first;
+  }
+  return &iter->second;
+}
+
+
+// Check if we need to deny this request due to rate limits
+bool scribeHandler::throttleRequest(unsigned long num_messages) {
+  // Check if we need to rate limit this client connection, then everyone.
+  // Tokens are only taken if the request is allowed.
+  shared_ptr<TokenBucket> connection =
+    ConnectionRateLimiter::getCurrentConnection();
+  if (connection && !connection->consume(num_messages)) {
+    deniedForConnectionRate->inc();
+    tokensDenied->add(num_messages);
+    return true;
+  }
+
+  if (!rateLimit.consume(num_messages)) {
+    if (connection) {
+      connection->refund(num_messages);
     }
-    for (store_list_t::iterator store_iter = pstores->begin();
-         store_iter != pstores->end();
+    deniedForRate->inc();
+    tokensDenied->add(num_messages);
+    return true;
+  }
+
+  return false;
+}
+
+// Check the rate limits of the StoreQueues each category is routed to.
+// Like throttleRequest(), this is one decision for the whole request, so
+// tokens already taken are put back if any queue denies it.
+bool scribeHandler::throttleCategories(const batch_map_t& batches) {
+  vector<pair<TokenBucket*, unsigned long> > taken;
+
+  for (batch_map_t::const_iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       ++batch_iter) {
+    const category_batch_t& batch = batch_iter->second;
+    if (batch.stores == NULL) {
+      continue;
+    }
+
+    unsigned long num_messages = batch.messages->size();
+    for (store_list_t::const_iterator store_iter = batch.stores->begin();
+         store_iter != batch.stores->end();
          ++store_iter) {
-      if (*store_iter == NULL) {
-        throw std::logic_error("throttle check: iterator in store map holds null pointer");
-      } else {
-        unsigned long long size = (*store_iter)->getSize();
-        if (size > maxQueueSize) {
-          incCounter((*store_iter)->getCategoryHandled(), "denied for queue size");
+      TokenBucket& bucket = (*store_iter)->getRateLimit();
+      if (!bucket.isLimited()) {
+        continue;
+      }
+
+      if (!bucket.consume(num_messages)) {
+        for (vector<pair<TokenBucket*, unsigned long> >::iterator iter =
+               taken.begin(); iter != taken.end(); ++iter) {
+          iter->first->refund(iter->second);
+        }
+        batch.counters->deniedForRate->inc();
+        batch.counters->tokensDenied->add(num_messages);
+        return true;
+      }
+      taken.push_back(make_pair(&bucket, num_messages));
+    }
+  }
+
+  return false;
+}
+
+// Throttle based on store queues getting too long.
+// Note that there's one decision for all categories, because the whole
+// array passed to us must either succeed or fail together. Checking before
+// we've queued anything also has the nice property that any size array
+// will succeed if we're unloaded before attempting it, so we won't hit a
+// case where there's a client request that will never succeed.
+// A queue over max_queue_size pushes back requests that would add to it,
+// and all requests whose categories are of its priority or lower, so
+// low priority categories are shed first and high priority ones keep
+// going while only lower ones are backed up. With every category at the
+// default priority, any overloaded queue denies every request.
+// StoreQueues report when they cross max_queue_size, so this check doesn't
+// depend on the number of categories.
+bool scribeHandler::throttleQueueSize(const batch_map_t& batches) {
+  if (numOverloadedQueues == 0) {
+    return false;
+  }
+
+  // the highest priority of the request
+  int priority = PRIORITY_LOW;
+  for (batch_map_t::const_iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       ++batch_iter) {
+    const category_batch_t& batch = batch_iter->second;
+    if (batch.stores == NULL) {
+      continue;
+    }
+
+    for (store_list_t::const_iterator store_iter = batch.stores->begin();
+         store_iter != batch.stores->end();
+         ++store_iter) {
+      if ((*store_iter)->isOverloaded()) {
+        incCounter((*store_iter)->getCategoryHandled(),
+                   "denied for queue size");
+        return true;
+      }
+      priority = max(priority, (int)(*store_iter)->getPriority());
+    }
+  }
+
+  for (int overloaded = priority; overloaded < NUM_PRIORITIES; ++overloaded) {
+    if (numOverloadedByPriority[overloaded] > 0) {
+      Guard overload_monitor(overloadLock);
+      for (set<StoreQueue*>::iterator iter = overloadedQueues.begin();
+           iter != overloadedQueues.end();
+           ++iter) {
+        if ((*iter)->getPriority() >= priority) {
+          incCounter((*iter)->getCategoryHandled(), "denied for queue size");
           return true;
         }
       }
@@ -327,6 +519,60 @@ bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
   return false;
 }
 
+// Check that the StoreQueues each category is routed to have room for
+// its messages in the memory budget. Queues that are spilling to disk
+// don't need any.
+bool scribeHandler::throttleMemory(const batch_map_t& batches) {
+  if (!memoryBudget.isLimited()) {
+    return false;
+  }
+
+  for (batch_map_t::const_iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       ++batch_iter) {
+    const category_batch_t& batch = batch_iter->second;
+    if (batch.stores == NULL) {
+      continue;
+    }
+
+    for (store_list_t::const_iterator store_iter = batch.stores->begin();
+         store_iter != batch.stores->end();
+         ++store_iter) {
+      if (!(*store_iter)->admit(batch.size)) {
+        batch.counters->deniedForMemory->inc();
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+// Give back the tokens taken by throttleRequest() for a request that was
+// denied or failed afterwards. connection is the bucket of the connection
+// it came in on, if any.
+void scribeHandler::refundRequest(unsigned long num_messages,
+                                  TokenBucket* connection) {
+  if (connection) {
+    connection->refund(num_messages);
+  }
+  rateLimit.refund(num_messages);
+}
+
+// Called by a StoreQueue whenever its size crosses maxQueueSize times
+// its weight
+void scribeHandler::setQueueOverloaded(StoreQueue* queue, bool overloaded) {
+  Guard overload_monitor(overloadLock);
+  if (overloaded) {
+    if (overloadedQueues.insert(queue).second) {
+      ++numOverloadedByPriority[queue->getPriority()];
+    }
+  } else if (overloadedQueues.erase(queue)) {
+    --numOverloadedByPriority[queue->getPriority()];
+  }
+  numOverloadedQueues = overloadedQueues.size();
+}
+
 // Should be called while holding a writeLock on scribeHandlerLock
 shared_ptr<store_list_t> scribeHandler::createNewCategory(
   const string& category) {
@@ -375,143 +621,273 @@ shared_ptr<store_list_t> scribeHandler::createNewCategory(
     }
   }
 
+  if (store_list) {
+    publishRoutes();
+  }
+
   return store_list;
 }
 
-// Add this message to every store in list
-void scribeHandler::addMessage(
-  const LogEntry& entry,
-  const shared_ptr<store_list_t>& store_list) {
+// Should be called while holding a writeLock on scribeHandlerLock
+// Stores copied from a model are only created when their category first
+// shows up, so create the ones a previous run left journals or spill files
+// for now, before any messages are accepted.
+void scribeHandler::recoverCategories() {
+  std::set<string> found;
+  for (store_list_t::iterator store_iter = defaultStores.begin();
+       store_iter != defaultStores.end(); ++store_iter) {
+    if ((*store_iter)->isModelStore()) {
+      (*store_iter)->getRecoverableCategories(found);
+    }
+  }
+  for (category_map_t::iterator cat_iter = category_prefixes.begin();
+       cat_iter != category_prefixes.end(); ++cat_iter) {
+    for (store_list_t::iterator store_iter = cat_iter->second->begin();
+         store_iter != cat_iter->second->end(); ++store_iter) {
+      if ((*store_iter)->isModelStore()) {
+        (*store_iter)->getRecoverableCategories(found);
+      }
+    }
+  }
+
+  for (std::set<string>::iterator iter = found.begin();
+       iter != found.end(); ++iter) {
+    if (categories.find(*iter) == categories.end()) {
+      LOG_OPER("[%s] creating category to read back what was left queued",
+               iter->c_str());
+      createNewCategory(*iter);
+    }
+  }
+}
 
+// Add these messages to every store in list
+void scribeHandler::addMessages(const std::string& category,
+                                const category_batch_t& batch) {
   int numstores = 0;
+  const logentry_vector_t& messages = *batch.messages;
 
-  // Add message to store_list
-  for (store_list_t::iterator store_iter = store_list->begin();
-       store_iter != store_list->end();
+  // Add messages to store_list. Every store gets references to the same
+  // copies of the messages, so the cost doesn't grow with the number of stores.
+  for (store_list_t::iterator store_iter = batch.stores->begin();
+       store_iter != batch.stores->end();
        ++store_iter) {
     ++numstores;
-    boost::shared_ptr<LogEntry> ptr(new LogEntry);
-    ptr->category = entry.category;
-    ptr->message = entry.message;
-
-    (*store_iter)->addMessage(ptr);
+    (*store_iter)->addMessages(messages);
   }
 
   if (numstores) {
-    incCounter(entry.category, "received good");
+    batch.counters->receivedGood->add(messages.size());
   } else {
-    incCounter(entry.category, "received bad");
+    batch.counters->receivedBad->add(messages.size());
   }
 }
 
+// With async dispatcher threads, the batch is only checked and copied here
+// and a dispatcher adds it to the stores later. Since this is a oneway call,
+// messages we can't take are dropped either way.
 void scribeHandler::LogAsync(const vector<LogEntry>&  messages) {
-  Log(messages);
+  if (!asyncQueue) {
+    Log(messages);
+    return;
+  }
+
+  if(status == STOPPING || throttleRequest(messages.size())) {
+    return;
+  }
+
+  async_batch_t* async_batch = new async_batch_t;
+  groupMessages(messages, async_batch->batches);
+  async_batch->numMessages = messages.size();
+  async_batch->enqueueTime = scribe::clock::monotonicInUsec();
+  // the dispatcher doesn't know which connection it came from
+  async_batch->connection = ConnectionRateLimiter::getCurrentConnection();
+
+  if (!asyncQueue->push(async_batch, asyncBlockWhenFull)) {
+    refundRequest(async_batch->numMessages, async_batch->connection.get());
+    asyncDropped->add(async_batch->numMessages);
+    delete async_batch;
+  }
+}
+
+// Body of the async dispatcher threads
+void scribeHandler::asyncDispatcher() {
+  while (true) {
+    async_batch_t* async_batch = asyncQueue->pop();
+
+    asyncHandoffs->inc();
+    unsigned long waited = scribe::clock::monotonicInUsec() -
+                           async_batch->enqueueTime;
+    asyncHandoffUsec->add(waited);
+    asyncWait->add(waited / 1000);
+
+    routing_table_t cats = getRoutes();
+    if (status == STOPPING ||
+        routeBatches(cats, async_batch->batches, async_batch->numMessages,
+                     async_batch->connection.get()) != OK) {
+      asyncDropped->add(async_batch->numMessages);
+    }
+    delete async_batch;
+  }
+}
+
+static void* asyncDispatcherStatic(void *handler_ptr) {
+  static_cast<scribeHandler*>(handler_ptr)->asyncDispatcher();
+  return NULL;
+}
+
+void scribeHandler::startAsyncDispatchers() {
+  asyncQueue = shared_ptr<AsyncQueue>(new AsyncQueue(asyncQueueSize));
+  for (size_t i = 0; i < numAsyncThreads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, asyncDispatcherStatic, this) != 0) {
+      throw runtime_error("failed to create async dispatcher thread");
+    }
+    pthread_detach(thread);
+  }
+  LOG_OPER("started <%lu> async dispatcher threads, queue size <%lu>",
+           (unsigned long)numAsyncThreads, asyncQueue->getCapacity());
 }
 
 ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
-  ResultCode result = TRY_LATER;
+  // Known categories are looked up in the published routing table without
+  // taking scribeHandlerLock. Holding on to the table also keeps
+  // stopStores() from stopping the stores we are adding messages to.
+  routing_table_t cats = getRoutes();
 
-  scribeHandlerLock->acquireRead();
   if(status == STOPPING) {
-    result = TRY_LATER;
-    goto end;
+    return TRY_LATER;
   }
 
-  if (throttleRequest(messages)) {
-    result = TRY_LATER;
-    goto end;
+  if (throttleRequest(messages.size())) {
+    return TRY_LATER;
   }
 
+  batch_map_t batches;
+  groupMessages(messages, batches);
+
+  return routeBatches(cats, batches, messages.size(),
+                      ConnectionRateLimiter::getCurrentConnection().get());
+}
+
+// Group the batch by category so that each StoreQueue is handed a whole
+// run of messages at once. Clients usually send many messages for a few
+// categories, and consecutive messages usually share a category.
+void scribeHandler::groupMessages(const vector<LogEntry>& messages,
+                                  batch_map_t& batches) {
+  category_batch_t* batch = NULL;
+
   for (vector<LogEntry>::const_iterator msg_iter = messages.begin();
        msg_iter != messages.end();
        ++msg_iter) {
 
     // disallow blank category from the start
     if ((*msg_iter).category.empty()) {
-      incCounter("received blank category");
+      receivedBlankCategory->inc();
       continue;
     }
 
-    shared_ptr<store_list_t> store_list;
-    string category = (*msg_iter).category;
+    if (!batch || batch->messages->back()->category != (*msg_iter).category) {
+      batch = &batches[(*msg_iter).category];
+      if (!batch->messages) {
+        batch->messages = shared_ptr<logentry_vector_t>(new logentry_vector_t);
+      }
+    }
+    batch->messages->push_back(logentry_ptr_t(new LogEntry(*msg_iter)));
+    batch->size += (*msg_iter).message.size();
+  }
+}
 
-    category_map_t::iterator cat_iter;
-    // First look for an exact match of the category
-    if ((cat_iter = categories.find(category)) != categories.end()) {
-      store_list = cat_iter->second;
+// Adds grouped messages to their stores, creating categories as needed.
+// num_messages is what throttleRequest() took tokens for, from connection
+// if it isn't NULL.
+ResultCode scribeHandler::routeBatches(routing_table_t& cats,
+                                       batch_map_t& batches,
+                                       unsigned long num_messages,
+                                       TokenBucket* connection) {
+  // Create the categories we don't know yet first, so that every batch
+  // finds its stores in the same routing table. A table released to take
+  // the write lock may be stopped by reinitialize() before we add to it.
+  for (batch_map_t::iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       ++batch_iter) {
+    if (cats->find(batch_iter->first) != cats->end()) {
+      continue;
     }
 
-    // Try creating a new store for this category if we didn't find one
-    if (store_list == NULL) {
-      // Need write lock to create a new category
-      scribeHandlerLock->release();
-      scribeHandlerLock->acquireWrite();
+    // Need write lock to create a new category. Release the routing table
+    // first, stopStores() waits for it while holding the write lock.
+    cats.reset();
+    RWGuard monitor(*scribeHandlerLock, true);
 
-      // This may cause some duplicate messages if some messages in this batch
-      // were already added to queues
-      if(status == STOPPING) {
-        result = TRY_LATER;
-        goto end;
-      }
+    if(status == STOPPING) {
+      refundRequest(num_messages, connection);
+      return TRY_LATER;
+    }
 
-      if ((cat_iter = categories.find(category)) != categories.end()) {
-        store_list = cat_iter->second;
-      } else {
-        store_list = createNewCategory(category);
+    // all of them, the ones we found may be gone by now
+    for (batch_iter = batches.begin(); batch_iter != batches.end();
+         ++batch_iter) {
+      if (categories.find(batch_iter->first) == categories.end()) {
+        createNewCategory(batch_iter->first);
       }
-
     }
 
-    if (store_list == NULL) {
-      LOG_OPER("log entry has invalid category <%s>", category.c_str());
-      incCounter(category, "received bad");
+    // routes are published while holding the write lock, so this
+    // has the categories if they exist now
+    cats = getRoutes();
+    break;
+  }
 
-      continue;
+  // Find the stores for every category before adding anything, so that
+  // the per-category rate limits can deny the request as a whole.
+  for (batch_map_t::iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       ++batch_iter) {
+    category_batch_t& batch = batch_iter->second;
+    route_map_t::const_iterator route_iter = cats->find(batch_iter->first);
+    if (route_iter != cats->end()) {
+      batch.stores = route_iter->second.stores;
+      batch.counters = route_iter->second.counters;
     }
-
-    // Log this message
-    addMessage(*msg_iter, store_list);
   }
 
-  result = OK;
-
- end:
-  scribeHandlerLock->release();
-  return result;
-}
+  // the checks that don't take anything first
+  if (throttleQueueSize(batches) || throttleMemory(batches) ||
+      throttleCategories(batches)) {
+    refundRequest(num_messages, connection);
+    return TRY_LATER;
+  }
 
-// Returns true if overloaded.
-// Allows a fixed number of messages per second.
-bool scribeHandler::throttleDeny(int num_messages) {
-  time_t now;
-  if (0 == maxMsgPerSecond)
-    return false;
+  for (batch_map_t::iterator batch_iter = batches.begin();
+       batch_iter != batches.end();
+       ++batch_iter) {
+    if (batch_iter->second.stores == NULL) {
+      LOG_OPER("log entry has invalid category <%s>", batch_iter->first.c_str());
+      incCounter(batch_iter->first, "received bad",
+                 batch_iter->second.messages->size());
 
-  time(&now);
-  if (now != lastMsgTime) {
-    lastMsgTime = now;
-    numMsgLastSecond = 0;
-  }
+      continue;
+    }
 
-  // If we get a single huge packet it's not cool, but we'd better
-  // accept it or we'll keep having to read it and deny it indefinitely
-  if (num_messages > (int)maxMsgPerSecond/2) {
-    LOG_OPER("throttle allowing rediculously large packet with <%d> messages", num_messages);
-    return false;
+    // Log this category's messages
+    addMessages(batch_iter->first, batch_iter->second);
   }
 
-  if (numMsgLastSecond + num_messages > maxMsgPerSecond) {
-    LOG_OPER("throttle denying request with <%d> messages. It would exceed max of <%lu> messages this second",
-           num_messages, maxMsgPerSecond);
-    return true;
-  } else {
-    numMsgLastSecond += num_messages;
-    return false;
-  }
+  return OK;
 }
 
+// Should be called while holding a writeLock on scribeHandlerLock
 void scribeHandler::stopStores() {
   setStatus(STOPPING);
+
+  // Unpublish the routing table and wait for Log() calls still using it, so
+  // no messages are added to a store after it has been stopped.
+  routing_table_t old_routes =
+    boost::atomic_exchange(&routes, routing_table_t(new route_map_t));
+  while (!old_routes.unique()) {
+    usleep(1000);
+  }
+
   shared_ptr<store_list_t> store_list;
   for (store_list_t::iterator store_iter = defaultStores.begin();
       store_iter != defaultStores.end(); ++store_iter) {
@@ -529,7 +905,9 @@ void scribeHandler::shutdown() {
   RWGuard monitor(*scribeHandlerLock, true);
   stopStores();
   // calling stop to allow thrift to clean up client states and exit
-  server->stop();
+  for (size_t i = 0; i < servers.size(); ++i) {
+    servers[i]->stop();
+  }
   scribe::stopServer();
 }
 
@@ -574,10 +952,24 @@ void scribeHandler::initialize() {
     config = localconfig;
 
     // load the global config
-    config.getUnsigned("max_msg_per_second", maxMsgPerSecond);
+    unsigned long max_msg_per_second = DEFAULT_MAX_MSG_PER_SECOND;
+    unsigned long max_msg_burst = 0;
+    config.getUnsigned("max_msg_per_second", max_msg_per_second);
+    config.getUnsigned("max_msg_burst", max_msg_burst);
+    rateLimit.configure(max_msg_per_second, max_msg_burst);
+    config.getUnsigned("max_conn_msg_per_second", maxConnMsgPerSecond);
+    config.getUnsigned("max_conn_msg_burst", maxConnMsgBurst);
     config.getUnsignedLongLong("max_queue_size", maxQueueSize);
-    config.getUnsigned("check_interval", checkPeriod);
-    if (checkPeriod == 0) {
+    unsigned long long max_total_queue_size = 0;
+    config.getUnsignedLongLong("max_total_queue_size", max_total_queue_size);
+    memoryBudget.configure(max_total_queue_size);
+    // check_interval is in seconds, check_interval_ms overrides it
+    unsigned long check_interval;
+    if (config.getUnsigned("check_interval", check_interval)) {
+      checkPeriod = (check_interval ? check_interval : 1) * 1000;
+    }
+    if (config.getUnsigned("check_interval_ms", checkPeriod) &&
+        checkPeriod == 0) {
       checkPeriod = 1;
     }
     config.getUnsigned("max_conn", maxConn);
@@ -614,12 +1006,51 @@ void scribeHandler::initialize() {
       }
     }
 
+    // only takes effect when the server starts
+    if (config.getUnsigned("num_io_threads", num_threads)) {
+      numIoThreads = (size_t) num_threads;
+
+      if (numIoThreads <= 0) {
+        LOG_OPER("invalid value for num_io_threads: %lu", num_threads);
+        throw runtime_error("invalid value for num_io_threads");
+      }
+    }
+
+    // LogAsync() dispatchers are started once, the first time we are
+    // configured. async_overflow is "drop" (default) or "block".
+    if (!asyncQueue) {
+      if (config.getUnsigned("num_async_threads", num_threads)) {
+        numAsyncThreads = (size_t) num_threads;
+      }
+      config.getUnsigned("async_queue_size", asyncQueueSize);
+      if (asyncQueueSize == 0) {
+        asyncQueueSize = 1;
+      }
+    }
+    string overflow;
+    config.getString("async_overflow", overflow);
+    asyncBlockWhenFull = (0 == overflow.compare("block"));
+
+    if (!asyncQueue && numAsyncThreads > 0) {
+      startAsyncDispatchers();
+    }
+
+    // StoreQueues run on a pool of num_store_threads threads instead of a
+    // thread each if this is set. Like the async dispatchers, the pool is
+    // created the first time we are configured.
+    if (!storeExecutor && config.getUnsigned("num_store_threads", num_threads)
+        && num_threads > 0) {
+      storeExecutor = shared_ptr<StoreExecutor>(
+        new StoreExecutor((size_t) num_threads));
+    }
+
 
     // Build a new map of stores, and move stores from the old map as
     // we find them in the config file. Any stores left in the old map
     // at the end will be deleted.
     std::vector<pStoreConf> store_confs;
     config.getAllStores(store_confs);
+    journalPaths.clear();
     for (std::vector<pStoreConf>::iterator iter = store_confs.begin();
          iter != store_confs.end();
          ++iter) {
@@ -652,8 +1083,12 @@ void scribeHandler::initialize() {
     // nothing configured and status set to WARNING
     deleteCategoryMap(categories);
     deleteCategoryMap(category_prefixes);
+  } else {
+    recoverCategories();
   }
 
+  publishRoutes();
+
 
   if (!perfect_config || !enough_config_to_run) {
     // perfect should be a subset of enough, but just in case
@@ -782,6 +1217,18 @@ shared_ptr<StoreQueue> scribeHandler::configureStoreCategory(
     return shared_ptr<StoreQueue>();
   }
 
+  // A second store would replay and truncate the first one's journal
+  string journal_path;
+  if (!category_list &&
+      store_conf->getString("journal_path", journal_path) &&
+      !journal_path.empty() &&
+      !journalPaths.insert(make_pair(category, journal_path)).second) {
+    string errormsg("Bad config - two stores with journal_path ");
+    errormsg += journal_path + " for category: " + category;
+    setStatusDetails(errormsg);
+    return shared_ptr<StoreQueue>();
+  }
+
   // look for the store in the current list
   shared_ptr<StoreQueue> pstore;
 
@@ -890,7 +1337,7 @@ void scribeHandler::deleteCategoryMap(category_map_t& cats) {
         (*store_iter)->stop();
       }
     } // for each store
-    pstores->clear();
+    // the list may have been published, so it is dropped, not emptied
   } // for each category
   cats.clear();
 }
@@ -26,10 +26,55 @@
 
 #include "store.h"
 #include "store_queue.h"
+#include "counters.h"
+#include "async_queue.h"
+#include "store_executor.h"
 
 typedef std::vector<boost::shared_ptr<StoreQueue> > store_list_t;
 typedef std::map<std::string, boost::shared_ptr<store_list_t> > category_map_t;
 
+// Counters Log() updates for each category
+struct category_counters_t {
+  CounterHandle* receivedGood;
+  CounterHandle* receivedBad;
+  CounterHandle* deniedForRate;
+  CounterHandle* tokensDenied;
+  CounterHandle* deniedForMemory;
+};
+
+// Where Log() sends the messages of a category
+struct route_t {
+  boost::shared_ptr<store_list_t> stores;
+  const category_counters_t* counters;
+};
+typedef std::map<std::string, route_t> route_map_t;
+
+// Immutable copy of the category map used by Log(). A new snapshot is
+// published whenever a category is added and store lists are never modified
+// once published, so readers don't need scribeHandlerLock.
+typedef boost::shared_ptr<const route_map_t> routing_table_t;
+
+// Messages of one category from a single Log() call and the stores
+// they are routed to
+struct category_batch_t {
+  boost::shared_ptr<logentry_vector_t> messages;
+  unsigned long long size; // in bytes
+  boost::shared_ptr<store_list_t> stores;
+  const category_counters_t* counters;
+
+  category_batch_t() : size(0), counters(NULL) {}
+};
+typedef std::map<std::string, category_batch_t> batch_map_t;
+
+// A LogAsync() call waiting for a dispatcher thread
+struct async_batch_t {
+  batch_map_t batches;
+  unsigned long numMessages;
+  // bucket of the connection it came in on, to refund if it is denied
+  boost::shared_ptr<TokenBucket> connection;
+  unsigned long enqueueTime; // in usec, from scribe::clock::monotonicInUsec()
+};
+
 class scribeHandler : virtual public scribe::thrift::scribeIf,
                               public facebook::fb303::FacebookBase {
 
@@ -56,11 +101,31 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   // number of threads processing new Thrift connections
   size_t numThriftServerThreads;
 
+  // number of threads accepting and reading Thrift connections, each with
+  // its own event loop and SO_REUSEPORT socket
+  size_t numIoThreads;
+
+  // number of threads adding LogAsync() batches to the stores.
+  // 0 means LogAsync() is handled like Log().
+  size_t numAsyncThreads;
+
 
   inline unsigned long long getMaxQueueSize() {
     return maxQueueSize;
   }
 
+  // NULL unless StoreQueues share num_store_threads threads
+  inline StoreExecutor* getStoreExecutor() {
+    return storeExecutor.get();
+  }
+
+  void setQueueOverloaded(StoreQueue* queue, bool overloaded);
+
+  // Bytes held by all StoreQueues, see max_total_queue_size
+  inline MemoryBudget& getMemoryBudget() {
+    return memoryBudget;
+  }
+
   inline const StoreConf& getConfig() const {
     return config;
   }
@@ -70,17 +135,43 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   void incCounter(std::string counter);
   void incCounter(std::string counter, long amount);
 
-  inline void setServer(
+  // Resolves a counter once for code that counts on every message or send.
+  // Counts are added to fb303 every second and whenever counters are read,
+  // and foldCounters() also summarizes the pipeline histograms over the
+  // last second.
+  CounterHandle* getCounterHandle(const std::string& category,
+                                  const std::string& counter);
+  CounterHandle* getCounterHandle(const std::string& counter);
+  LatencyHistogram* getLatencyHistogram(const std::string& category,
+                                        const std::string& name);
+  void foldCounters();
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void asyncDispatcher();
+
+  void getCounters(std::map<std::string, int64_t>& _return);
+  int64_t getCounter(const std::string& key);
+
+  inline void addServer(
       boost::shared_ptr<apache::thrift::server::TNonblockingServer> & server) {
-    this->server = server;
+    servers.push_back(server);
   }
   unsigned long getMaxConn() {
     return maxConn;
   }
+  unsigned long getMaxConnMsgPerSecond() {
+    return maxConnMsgPerSecond;
+  }
+  unsigned long getMaxConnMsgBurst() {
+    return maxConnMsgBurst;
+  }
  private:
-  boost::shared_ptr<apache::thrift::server::TNonblockingServer> server;
+  // one per I/O thread
+  std::vector<boost::shared_ptr<apache::thrift::server::TNonblockingServer> >
+    servers;
 
-  unsigned long checkPeriod; // periodic check interval for all contained stores
+  unsigned long checkPeriod; // periodic check interval for all contained stores, in msec
 
   // This map has an entry for each configured category.
   // Each of these entries is a map of type->StoreQueue.
@@ -88,18 +179,58 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   category_map_t categories;
   category_map_t category_prefixes;
 
+  // Snapshot of categories for the Log() hot path.
+  // Only access through getRoutes() and publishRoutes().
+  routing_table_t routes;
+
+  // Per category counters for the routing table. Never removed, so
+  // published routes can keep pointers to them.
+  std::map<std::string, category_counters_t> categoryCounters;
+
+  CounterRegistry counterRegistry;
+  CounterHandle* receivedBlankCategory;
+  CounterHandle* deniedForRate;
+  CounterHandle* deniedForConnectionRate;
+  CounterHandle* tokensDenied;
+
+  // LogAsync() handoff, see async_queue_size and async_overflow
+  boost::shared_ptr<AsyncQueue> asyncQueue;
+  unsigned long asyncQueueSize;
+  bool asyncBlockWhenFull;
+  CounterHandle* asyncDropped;
+  CounterHandle* asyncHandoffs;
+  CounterHandle* asyncHandoffUsec;
+  LatencyHistogram* asyncWait;     // from LogAsync() to a dispatcher
+
+  // shared store threads, see num_store_threads
+  boost::shared_ptr<StoreExecutor> storeExecutor;
+
   // the default stores
   store_list_t defaultStores;
 
+  // category and journal_path of every store configured. Journals are
+  // named by category, so two stores of a category can't share a path.
+  std::set<std::pair<std::string, std::string> > journalPaths;
+
   std::string configFilename;
   facebook::fb303::fb_status status;
   std::string statusDetails;
   apache::thrift::concurrency::Mutex statusLock;
-  time_t lastMsgTime;
-  unsigned long numMsgLastSecond;
-  unsigned long maxMsgPerSecond;
+  TokenBucket rateLimit; // for all messages, see max_msg_per_second
+  unsigned long maxConnMsgPerSecond;
+  unsigned long maxConnMsgBurst;
   unsigned long maxConn;
   unsigned long long maxQueueSize;
+
+  // StoreQueues currently holding more than maxQueueSize times their
+  // weight. The counts are read by throttleQueueSize() without the lock.
+  std::set<StoreQueue*> overloadedQueues;
+  volatile unsigned long numOverloadedQueues;
+  volatile unsigned long numOverloadedByPriority[NUM_PRIORITIES];
+  apache::thrift::concurrency::Mutex overloadLock;
+
+  MemoryBudget memoryBudget;
+
   StoreConf config;
   bool newThreadPerCategory;
 
@@ -116,7 +247,6 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   const scribeHandler& operator=(const scribeHandler& rhs);
 
  protected:
-  bool throttleDeny(int num_messages); // returns true if overloaded
   void deleteCategoryMap(category_map_t& cats);
   const char* statusAsString(facebook::fb303::fb_status new_status);
   bool createCategoryFromModel(const std::string &category,
@@ -128,11 +258,25 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
                            bool category_list=false);
   bool configureStore(pStoreConf store_conf, int* num_stores);
   void stopStores();
-  bool throttleRequest(const std::vector<scribe::thrift::LogEntry>&  messages);
+  bool throttleRequest(unsigned long num_messages);
+  bool throttleCategories(const batch_map_t& batches);
+  bool throttleMemory(const batch_map_t& batches);
+  bool throttleQueueSize(const batch_map_t& batches);
+  void refundRequest(unsigned long num_messages, TokenBucket* connection);
+  routing_table_t getRoutes();
+  void publishRoutes();
   boost::shared_ptr<store_list_t>
     createNewCategory(const std::string& category);
-  void addMessage(const scribe::thrift::LogEntry& entry,
-                  const boost::shared_ptr<store_list_t>& store_list);
+  void recoverCategories();
+  const category_counters_t* getCategoryCounters(const std::string& category);
+  void startAsyncDispatchers();
+  void groupMessages(const std::vector<scribe::thrift::LogEntry>& messages,
+                     batch_map_t& batches);
+  scribe::thrift::ResultCode routeBatches(routing_table_t& cats,
+                                          batch_map_t& batches,
+                                          unsigned long num_messages,
+                                          TokenBucket* connection);
+  void addMessages(const std::string& category, const category_batch_t& batch);
 };
 extern boost::shared_ptr<scribeHandler> g_Handler;
 #endif // SCRIBE_SERVER_H
@@ -0,0 +1,278 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include "common.h"
+#include "spill_file.h"
+
+using namespace std;
+using namespace scribe::thrift;
+using boost::shared_ptr;
+
+SpillFile::SpillFile(const string& path_, const string& name)
+  : path(path_),
+    filename(path_ + "/" + name),
+    offsetFilename(filename + ".read"),
+    writeOffset(0),
+    readOffset(0),
+    skipOffset(0) {
+}
+
+SpillFile::~SpillFile() {
+  if (writer) {
+    writer->close();
+  }
+  if (reader) {
+    reader->close();
+  }
+}
+
+unsigned long long SpillFile::recover() {
+  readOffset = 0;
+  writeOffset = 0;
+  skipOffset = 0;
+  try {
+    boost::filesystem::create_directories(path);
+    if (boost::filesystem::exists(filename)) {
+      writeOffset = boost::filesystem::file_size(filename);
+    }
+  } catch (const std::exception& e) {
+    LOG_OPER("exception <%s> looking for spill file <%s>",
+             e.what(), filename.c_str());
+  }
+
+  // Without a saved offset the last run didn't get to close the file, and
+  // what it had read back may not have been written yet
+  unsigned long long offset = 0;
+  ifstream in(offsetFilename.c_str());
+  if (in >> offset) {
+    if (offset <= writeOffset) {
+      readOffset = skipOffset = offset;
+    } else {
+      LOG_OPER("ignoring read offset <%llu> past the end of spill file <%s>",
+               offset, filename.c_str());
+    }
+  }
+  in.close();
+
+  if (writeOffset > 0 && empty()) {
+    reset();
+  }
+  return writeOffset - readOffset;
+}
+
+void SpillFile::appendFrame(string& buffer, const string& data) {
+  buffer += writer->getFrame(data.size() + 1);
+  buffer += data;
+  buffer += '\n';
+}
+
+bool SpillFile::append(const logentry_vector_t& entries,
+                       unsigned long enqueue_time) {
+  if (!writer) {
+    writer = FileInterface::createFileInterface("std", filename, true);
+    if (!writer->openWrite()) {
+      LOG_OPER("failed to open spill file <%s> for writing",
+               filename.c_str());
+      writer.reset();
+      return false;
+    }
+  }
+
+  ostringstream header;
+  header << enqueue_time << " " << entries.size();
+
+  string buffer;
+  appendFrame(buffer, header.str());
+  for (logentry_vector_t::const_iterator iter = entries.begin();
+       iter != entries.end();
+       ++iter) {
+    appendFrame(buffer, (*iter)->category);
+    appendFrame(buffer, (*iter)->message);
+  }
+
+  // The stream may only fail once it is flushed, so the file size says
+  // whether all of it made it
+  bool written = writer->write(buffer) && writer->flush();
+  if (written) {
+    written = writer->fileSize() == writeOffset + buffer.size();
+  }
+  if (!written) {
+    LOG_OPER("failed to write to spill file <%s>", filename.c_str());
+    writer->close();
+    writer.reset();
+    truncate();
+    return false;
+  }
+  writeOffset += buffer.size();
+  return true;
+}
+
+// Cuts off what a failed append left behind, so that the next one
+// follows the last complete batch
+void SpillFile::truncate() {
+  try {
+    if (boost::filesystem::exists(filename)) {
+      boost::filesystem::resize_file(filename, writeOffset);
+    }
+  } catch (const std::exception& e) {
+    // whatever made it to the file will show up as corruption when
+    // it is read back
+    LOG_OPER("exception <%s> truncating spill file <%s>",
+             e.what(), filename.c_str());
+  }
+}
+
+bool SpillFile::readFrame(string& data) {
+  long size = reader->readNext(data);
+  if (size <= 0 || data.empty() || data[data.size() - 1] != '\n') {
+    LOG_OPER("corrupt spill file <%s> at offset <%llu>",
+             filename.c_str(), readOffset);
+    return false;
+  }
+  readOffset += reader->getFrame(size).size() + size;
+  data.resize(data.size() - 1);
+  return true;
+}
+
+bool SpillFile::openReader() {
+  if (reader) {
+    reader->close();
+  }
+  reader = FileInterface::createFileInterface("std", filename, true);
+  if (!reader->openRead()) {
+    LOG_OPER("failed to open spill file <%s> for reading",
+             filename.c_str());
+    reader.reset();
+    return false;
+  }
+  return true;
+}
+
+// Reads past the frames a previous run has already read back. Returns
+// false if they don't end at skipOffset.
+bool SpillFile::skip() {
+  unsigned long long offset = 0;
+  string frame;
+  while (offset < skipOffset) {
+    long size = reader->readNext(frame);
+    if (size <= 0) {
+      break;
+    }
+    offset += reader->getFrame(size).size() + size;
+  }
+  bool ok = offset == skipOffset;
+  skipOffset = 0;
+  return ok;
+}
+
+bool SpillFile::read(unsigned long long max_bytes,
+                     logentry_vector_t& messages,
+                     batch_times_t& batch_times) {
+  if (!reader) {
+    if (!openReader()) {
+      return false;
+    }
+    if (!skip()) {
+      // better to write some of it twice than to lose the rest
+      LOG_OPER("reading spill file <%s> from the start, no frame ends at <%llu>",
+               filename.c_str(), readOffset);
+      readOffset = 0;
+      if (!openReader()) {
+        return false;
+      }
+    }
+  }
+
+  // Only ever read what has been written and flushed, so the reader
+  // never runs into the end of the file while we are still appending.
+  unsigned long long bytes = 0;
+  string header;
+  while (readOffset < writeOffset && bytes < max_bytes) {
+    if (!readFrame(header)) {
+      return false;
+    }
+    unsigned long enqueue_time = 0;
+    unsigned long count = 0;
+    istringstream(header) >> enqueue_time >> count;
+
+    for (unsigned long i = 0; i < count; ++i) {
+      shared_ptr<LogEntry> entry(new LogEntry);
+      if (!readFrame(entry->category) || !readFrame(entry->message)) {
+        return false;
+      }
+      bytes += entry->message.size();
+      messages.push_back(entry);
+    }
+    batch_times.push_back(make_pair(enqueue_time, count));
+  }
+  return true;
+}
+
+void SpillFile::reset() {
+  if (writer) {
+    writer->close();
+    writer.reset();
+  }
+  if (reader) {
+    reader->close();
+    reader.reset();
+  }
+  try {
+    boost::filesystem::remove(filename);
+    boost::filesystem::remove(offsetFilename);
+  } catch (const std::exception& e) {
+    LOG_OPER("exception <%s> removing spill file <%s>",
+             e.what(), filename.c_str());
+  }
+  writeOffset = 0;
+  readOffset = 0;
+  skipOffset = 0;
+}
+
+void SpillFile::close() {
+  if (empty()) {
+    reset();
+    return;
+  }
+  if (writer) {
+    writer->close();
+    writer.reset();
+  }
+  if (reader) {
+    reader->close();
+    reader.reset();
+  }
+  if (readOffset == 0) {
+    return;
+  }
+
+  // renamed into place so that a crash can't leave half an offset
+  string tmp = offsetFilename + ".tmp";
+  ofstream out(tmp.c_str(), ios::out | ios::trunc);
+  out << readOffset << endl;
+  out.close();
+  try {
+    if (!out) {
+      throw std::runtime_error("write failed");
+    }
+    boost::filesystem::rename(tmp, offsetFilename);
+  } catch (const std::exception& e) {
+    LOG_OPER("exception <%s> saving the read offset of spill file <%s>",
+             e.what(), filename.c_str());
+  }
+}
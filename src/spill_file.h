@@ -0,0 +1,97 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_SPILL_FILE_H
+#define SCRIBE_SPILL_FILE_H
+
+#include "common.h"
+#include "file.h"
+
+// enqueue time in msec and number of messages of each batch
+typedef std::vector<std::pair<unsigned long, unsigned long> > batch_times_t;
+
+/*
+ * Batches a StoreQueue couldn't keep in memory, appended to a local file
+ * with StdFile framing and read back in the order they were written.
+ * Every batch is a frame holding "<enqueue time> <count>" followed by a
+ * category and a message frame for each of its messages. Frames end in a
+ * newline so that empty categories and messages don't look like the end
+ * of the file.
+ * The file is left behind when the StoreQueue stops and picked up again by
+ * recover(), which carries on from the offset close() saved in
+ * <file>.read, or from the start if it wasn't closed.
+ * Not thread safe, StoreQueue serializes access.
+ */
+class SpillFile {
+ public:
+  SpillFile(const std::string& path, const std::string& name);
+  ~SpillFile();
+
+  // Picks up a spill file left by a previous run.
+  // Returns the number of bytes that are still to be read.
+  unsigned long long recover();
+
+  bool append(const logentry_vector_t& entries, unsigned long enqueue_time);
+
+  // Reads whole batches until at least max_bytes of messages have been
+  // read or the file has been read to the end. Returns false if the file
+  // is corrupt, messages read up to that point are still returned.
+  bool read(unsigned long long max_bytes, logentry_vector_t& messages,
+            batch_times_t& batch_times);
+
+  // Deletes the file and starts over
+  void reset();
+
+  // Closes the file and saves how far it has been read for recover(), or
+  // deletes it if it has all been read.
+  void close();
+
+  inline bool empty() const {
+    return readOffset >= writeOffset;
+  }
+  // bytes written since the file was last reset
+  inline unsigned long long size() const {
+    return writeOffset;
+  }
+  inline const std::string& getFilename() const {
+    return filename;
+  }
+
+ private:
+  bool readFrame(std::string& data);
+  void appendFrame(std::string& buffer, const std::string& data);
+  void truncate();
+  bool openReader();
+  bool skip();
+
+  std::string path;
+  std::string filename;
+  std::string offsetFilename;
+  boost::shared_ptr<FileInterface> writer;
+  boost::shared_ptr<FileInterface> reader;
+  unsigned long long writeOffset;
+  unsigned long long readOffset;
+  // where the reader has to get to before reading
+  unsigned long long skipOffset;
+
+  // disallow copy and assignment
+  SpillFile(const SpillFile& rhs);
+  const SpillFile& operator=(const SpillFile& rhs);
+};
+
+#endif // SCRIBE_SPILL_FILE_H
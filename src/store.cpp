@@ -25,6 +25,7 @@
 // @author John Song
 
 #include <algorithm>
+#include <deque>
 #include <boost/regex.hpp>
 #include "common.h"
 #include "scribe_server.h"
@@ -49,6 +50,9 @@ using namespace scribe::thrift;
 #define DEFAULT_FILESTORE_MAX_WRITE_SIZE          1000000
 #define DEFAULT_FILESTORE_ROLL_HOUR               1
 #define DEFAULT_FILESTORE_ROLL_MINUTE             15
+#define DEFAULT_FILESTORE_SYNC_INTERVAL_MS        1000
+#define DEFAULT_FILESTORE_SYNC_BYTES              1048576
+#define DEFAULT_FILESTORE_COMPRESSION_BLOCK_SIZE  262144
 #define DEFAULT_BUFFERSTORE_SEND_RATE             1
 #define DEFAULT_BUFFERSTORE_AVG_RETRY_INTERVAL    300
 #define DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE  60
@@ -208,6 +212,13 @@ FileStoreBase::FileStoreBase(StoreQueue* storeq,
     rollHour(DEFAULT_FILESTORE_ROLL_HOUR),
     rollMinute(DEFAULT_FILESTORE_ROLL_MINUTE),
     fsType("std"),
+    writeBufferSize(0),
+    fadvise(false),
+    syncPolicy(SYNC_NONE),
+    syncIntervalMs(DEFAULT_FILESTORE_SYNC_INTERVAL_MS),
+    syncBytes(DEFAULT_FILESTORE_SYNC_BYTES),
+    compression(CODEC_NONE),
+    compressionBlockSize(DEFAULT_FILESTORE_COMPRESSION_BLOCK_SIZE),
     chunkSize(0),
     writeMeta(false),
     writeCategory(false),
@@ -217,6 +228,13 @@ FileStoreBase::FileStoreBase(StoreQueue* storeq,
     rotateIfData(false),
     currentSize(0),
     lastRollTime(0),
+    bytesBeforeCompression(g_Handler->getCounterHandle(category,
+                             "bytes before compression")),
+    bytesAfterCompression(g_Handler->getCounterHandle(category,
+                            "bytes after compression")),
+    compressionRatio(g_Handler->getCounterHandle(category,
+                       "compression ratio x100")),
+    reportedCompressionRatio(0),
     eventsWritten(0) {
 }
 
@@ -319,6 +337,37 @@ void FileStoreBase::configure(pStoreConf configuration, pStoreConf parent) {
   }
 
   configuration->getString("fs_type", fsType);
+  configuration->getUnsigned("write_buffer_size", writeBufferSize);
+
+  if (configuration->getString("sync_policy", tmp)) {
+    if (0 == tmp.compare("none")) {
+      syncPolicy = SYNC_NONE;
+    } else if (0 == tmp.compare("interval_ms")) {
+      syncPolicy = SYNC_INTERVAL;
+    } else if (0 == tmp.compare("bytes")) {
+      syncPolicy = SYNC_BYTES;
+    } else if (0 == tmp.compare("per_batch")) {
+      syncPolicy = SYNC_PER_BATCH;
+    } else {
+      LOG_OPER("[%s] Bad config - invalid sync_policy <%s>, using none",
+               categoryHandled.c_str(), tmp.c_str());
+      syncPolicy = SYNC_NONE;
+    }
+  }
+  configuration->getUnsigned("sync_interval_ms", syncIntervalMs);
+  configuration->getUnsigned("sync_bytes", syncBytes);
+
+  if (configuration->getString("compression", tmp)) {
+    parseCodec(tmp, compression);
+  }
+  configuration->getUnsigned("compression_block_size", compressionBlockSize);
+  if (configuration->getString("fadvise", tmp)) {
+    if (0 == tmp.compare("yes")) {
+      fadvise = true;
+    } else {
+      fadvise = false;
+    }
+  }
 
   configuration->getUnsigned("max_size", maxSize);
   if(0 == maxSize) {
@@ -354,6 +403,13 @@ void FileStoreBase::copyCommon(const FileStoreBase *base) {
   rollHour = base->rollHour;
   rollMinute = base->rollMinute;
   fsType = base->fsType;
+  writeBufferSize = base->writeBufferSize;
+  fadvise = base->fadvise;
+  syncPolicy = base->syncPolicy;
+  syncIntervalMs = base->syncIntervalMs;
+  syncBytes = base->syncBytes;
+  compression = base->compression;
+  compressionBlockSize = base->compressionBlockSize;
   writeMeta = base->writeMeta;
   writeCategory = base->writeCategory;
   createSymlink = base->createSymlink;
@@ -600,6 +656,46 @@ void FileStoreBase::printStats(struct tm* creation_time) {
   stats_file->close();
 }
 
+shared_ptr<FileInterface> FileStoreBase::createFile(const string& name,
+                                                   bool framed) {
+  if (compression == CODEC_NONE) {
+    return FileInterface::createFileInterface(fsType, name, framed);
+  }
+
+  // blocks are frames of the file underneath
+  shared_ptr<FileInterface> file =
+    FileInterface::createFileInterface(fsType, name, true);
+  if (!file) {
+    return file;
+  }
+  // a block per chunk, so that blocks start on chunk boundaries
+  unsigned long block_size = chunkSize ? chunkSize : compressionBlockSize;
+  if (block_size == 0) {
+    block_size = DEFAULT_FILESTORE_COMPRESSION_BLOCK_SIZE;
+  }
+  return shared_ptr<FileInterface>(
+    new CompressedFile(file, name, framed, compression, block_size,
+                       &compressionStats));
+}
+
+void FileStoreBase::reportCompression() {
+  if (compressionStats.original == 0) {
+    return;
+  }
+  bytesBeforeCompression->add(compressionStats.original);
+  bytesAfterCompression->add(compressionStats.compressed);
+  compressionTotal.original += compressionStats.original;
+  compressionTotal.compressed += compressionStats.compressed;
+  compressionStats = compression_stats_t();
+
+  long ratio = 0;
+  if (compressionTotal.compressed > 0) {
+    ratio = 100 * compressionTotal.original / compressionTotal.compressed;
+  }
+  compressionRatio->add(ratio - reportedCompressionRatio);
+  reportedCompressionRatio = ratio;
+}
+
 // Returns the number of bytes to pad to align to the specified chunk size
 unsigned long FileStoreBase::bytesToPad(unsigned long next_message_length,
                                         unsigned long current_file_size,
@@ -649,6 +745,10 @@ FileStore::FileStore(StoreQueue* storeq,
   : FileStoreBase(storeq, category, "file", multi_category),
     isBufferFile(is_buffer_file),
     addNewlines(false),
+    unsyncedBytes(0),
+    lastSync(scribe::clock::monotonicInMsec()),
+    syncTime(g_Handler->getLatencyHistogram(category, "sync ms")),
+    bytesSynced(g_Handler->getCounterHandle(category, "bytes synced")),
     lostBytes_(0) {
 }
 
@@ -736,16 +836,20 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
       if (writeMeta) {
         writeFile->write(meta_logfile_prefix + file);
       }
+      if (syncPolicy != SYNC_NONE) {
+        syncFile();
+      }
       writeFile->close();
     }
 
-    writeFile = FileInterface::createFileInterface(fsType, file, isBufferFile);
+    writeFile = createFile(file, isBufferFile);
     if (!writeFile) {
       LOG_OPER("[%s] Failed to create file <%s> of type <%s> for writing",
                categoryHandled.c_str(), file.c_str(), fsType.c_str());
       setStatus("file open error");
       return false;
     }
+    writeFile->setBufferSize(writeBufferSize);
 
     success = writeFile->createDirectory(baseFilePath);
 
@@ -808,16 +912,74 @@ bool FileStore::isOpen() {
 
 void FileStore::close() {
   if (writeFile) {
+    if (syncPolicy != SYNC_NONE && writeFile->isOpen()) {
+      syncFile();
+    }
     writeFile->close();
   }
 }
 
 void FileStore::flush() {
-  if (writeFile) {
-    writeFile->flush();
+  // what was buffered is retried when the file is closed, and lost if
+  // that fails too
+  if (writeFile && !writeFile->flush()) {
+    LOG_OPER("[%s] Failed to flush file <%s>: %s",
+             categoryHandled.c_str(), currentFilename.c_str(),
+             strerror(errno));
+    setStatus("File flush error");
+    close();
+  }
+  reportCompression();
+}
+
+void FileStore::periodicCheck() {
+  FileStoreBase::periodicCheck();
+
+  // don't leave data unsynced for longer than the interval while idle
+  if (syncPolicy == SYNC_INTERVAL && unsyncedBytes > 0 && syncDue()) {
+    if (!syncFile()) {
+      close();
+    }
   }
 }
 
+bool FileStore::syncDue() {
+  switch (syncPolicy) {
+    case SYNC_PER_BATCH:
+      return true;
+    case SYNC_BYTES:
+      return unsyncedBytes >= syncBytes;
+    case SYNC_INTERVAL:
+      return scribe::clock::monotonicInMsec() - lastSync >= syncIntervalMs;
+    case SYNC_NONE:
+      break;
+  }
+  return false;
+}
+
+bool FileStore::syncFile() {
+  unsigned long start = scribe::clock::monotonicInMsec();
+  lastSync = start;
+  if (unsyncedBytes == 0 || !writeFile) {
+    return true;
+  }
+
+  bool success = writeFile->sync();
+  unsigned long now = scribe::clock::monotonicInMsec();
+  syncTime->add(now - start);
+  lastSync = now;
+  if (success) {
+    bytesSynced->add(unsyncedBytes);
+  } else {
+    LOG_OPER("[%s] Failed to sync <%lu> bytes to file <%s>: %s",
+             categoryHandled.c_str(), unsyncedBytes, currentFilename.c_str(),
+             strerror(errno));
+    setStatus("File sync error");
+  }
+  unsyncedBytes = 0;
+  return success;
+}
+
 shared_ptr<Store> FileStore::copy(const std::string &category) {
   FileStore *store = new FileStore(storeQueue, category, multiCategory,
                                    isBufferFile);
@@ -839,16 +1001,45 @@ bool FileStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
   }
 
   // write messages to current file
-  return writeMessages(messages);
+  if (!writeMessages(messages)) {
+    return false;
+  }
+
+  // Retry the batch if it didn't make it to disk. What earlier batches had
+  // left unsynced may be lost, the log says how much.
+  if (syncDue() && !syncFile()) {
+    close();
+    return false;
+  }
+  return true;
 }
 
 // writes messages to either the specified file or the the current writeFile
+// Adds a buffer for writev, skipping empty ones
+static void appendBuffer(vector<struct iovec>& buffers,
+                         const char* data, size_t length) {
+  if (length > 0) {
+    struct iovec buffer;
+    buffer.iov_base = (void*)data;
+    buffer.iov_len = length;
+    buffers.push_back(buffer);
+  }
+}
+
+static void appendBuffer(vector<struct iovec>& buffers, const string& data) {
+  appendBuffer(buffers, data.data(), data.length());
+}
+
 bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
                               boost::shared_ptr<FileInterface> file) {
-  // Data is written to a buffer first, then sent to disk in one call to write.
-  // This costs an extra copy of the data, but dramatically improves latency with
-  // network based files. (nfs, etc)
-  string        write_buffer;
+  // Data is gathered into a list of buffers first, then sent to disk in one
+  // call to writev. Messages and categories are pointed to where they are,
+  // only frames and padding are kept in frames, so nothing is copied before
+  // the file gets it. One call dramatically improves latency with network
+  // based files. (nfs, etc)
+  static const char newline = '\n';
+  vector<struct iovec> write_buffer;
+  deque<string> frames;  // never moves what it holds while growing
   bool          success = true;
   unsigned long current_size_buffered = 0; // size of data in write_buffer
   unsigned long num_buffered = 0;
@@ -900,19 +1091,27 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       length += padding;
 
       if (padding) {
-        write_buffer += string(padding, 0);
+        frames.push_back(string(padding, 0));
+        appendBuffer(write_buffer, frames.back());
       }
 
       if (writeCategory) {
-        write_buffer += category_frame;
-        write_buffer += (*iter)->category + "\n";
+        if (!category_frame.empty()) {
+          frames.push_back(category_frame);
+          appendBuffer(write_buffer, frames.back());
+        }
+        appendBuffer(write_buffer, (*iter)->category);
+        appendBuffer(write_buffer, &newline, 1);
       }
 
-      write_buffer += frame;
-      write_buffer += (*iter)->message;
+      if (!frame.empty()) {
+        frames.push_back(frame);
+        appendBuffer(write_buffer, frames.back());
+      }
+      appendBuffer(write_buffer, (*iter)->message);
 
       if (addNewlines) {
-        write_buffer += "\n";
+        appendBuffer(write_buffer, &newline, 1);
       }
 
       current_size_buffered += length;
@@ -921,7 +1120,8 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       // Write buffer if processing last message or if larger than allowed
       if ((current_size_buffered > max_write_size && maxSize != 0) ||
           messages->end() == iter + 1 ) {
-        if (!write_file->write(write_buffer)) {
+        if (!write_buffer.empty() &&
+            !write_file->writev(&write_buffer[0], write_buffer.size())) {
           LOG_OPER("[%s] File store failed to write (%lu) messages to file",
                    categoryHandled.c_str(), messages->size());
           setStatus("File write error");
@@ -931,9 +1131,13 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
 
         num_written += num_buffered;
         currentSize += current_size_buffered;
+        if (!file) {
+          unsyncedBytes += current_size_buffered;
+        }
         num_buffered = 0;
         current_size_buffered = 0;
-        write_buffer = "";
+        write_buffer.clear();
+        frames.clear();
       }
 
       // rotate file if large enough and not writing to a separate file
@@ -994,13 +1198,16 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
   // Need to close and reopen store in case we already have this file open
   close();
 
-  shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType,
-                                          filename, isBufferFile);
+  shared_ptr<FileInterface> infile = createFile(filename, isBufferFile);
+  infile->setBufferSize(writeBufferSize);
 
   // overwrite the old contents of the file
   bool success;
   if (infile->openTruncate()) {
     success = writeMessages(messages, infile);
+    if (success && syncPolicy != SYNC_NONE) {
+      success = infile->sync();
+    }
 
   } else {
     LOG_OPER("[%s] Failed to open file <%s> for writing and truncate",
@@ -1028,8 +1235,9 @@ bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages
   }
   std::string filename = makeFullFilename(index, now);
 
-  shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType,
-                                              filename, isBufferFile);
+  shared_ptr<FileInterface> infile = createFile(filename, isBufferFile);
+  infile->setBufferSize(writeBufferSize);
+  infile->setFadvise(fadvise);
 
   if (!infile->openRead()) {
     LOG_OPER("[%s] Failed to open file <%s> for reading",
@@ -1041,7 +1249,7 @@ bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages
   std::string message;
   while ((loss = infile->readNext(message)) > 0) {
     if (!message.empty()) {
-      logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
+      boost::shared_ptr<LogEntry> entry(new LogEntry);
 
       // check whether a category is stored with the message
       if (writeCategory) {
@@ -1314,7 +1522,8 @@ BufferStore::BufferStore(StoreQueue* storeq,
     numContSuccess(0),
     state(DISCONNECTED),
     flushStreaming(false),
-    maxByPassRatio(DEFAULT_BUFFERSTORE_BYPASS_MAXQSIZE_RATIO) {
+    maxByPassRatio(DEFAULT_BUFFERSTORE_BYPASS_MAXQSIZE_RATIO),
+    replayTime(g_Handler->getLatencyHistogram(category, "replay ms")) {
 
     lastOpenAttempt = time(NULL);
 
@@ -1640,7 +1849,21 @@ void BufferStore::periodicCheck() {
 
           unsigned long size = messages->size();
           if (size) {
-            if (primaryStore->handleMessages(messages)) {
+            // held in memory until the primary has taken them
+            unsigned long long bytes = 0;
+            for (logentry_vector_t::iterator iter = messages->begin();
+                 iter != messages->end();
+                 ++iter) {
+              bytes += (*iter)->message.size();
+            }
+            MemoryCharge charge(storeQueue ? &storeQueue->getMemoryAccount()
+                                           : NULL,
+                                bytes);
+
+            unsigned long start = scribe::clock::monotonicInMsec();
+            bool handled = primaryStore->handleMessages(messages);
+            replayTime->add(scribe::clock::monotonicInMsec() - start);
+            if (handled) {
               secondaryStore->deleteOldest(&nowinfo);
               if (adaptiveBackoff) {
                 setNewRetryInterval(true);
@@ -1861,6 +2084,10 @@ void NetworkStore::configure(pStoreConf configuration, pStoreConf parent) {
       newCategory = "";
   }
 
+  // protocol and compression, invalid values are logged and ignored
+  wireFormat = wire_format_t();
+  wireFormat.configure(configuration);
+
   // if this network store dynamic configured?
   // get network dynamic updater parameters
   string dynamicType;
@@ -1936,14 +2163,15 @@ bool NetworkStore::open() {
     }
 
     if (useConnPool) {
-      opened = g_connPool.open(serviceName, servers, static_cast<int>(timeout));
+      opened = g_connPool.open(serviceName, servers,
+          static_cast<int>(timeout), wireFormat);
     } else {
       if (unpooledConn != NULL) {
         LOG_OPER("Logic error: NetworkStore::open unpooledConn is not NULL"
             " service = %s", serviceName.c_str());
       }
       unpooledConn = shared_ptr<scribeConn>(new scribeConn(serviceName,
-            servers, static_cast<int>(timeout)));
+            servers, static_cast<int>(timeout), wireFormat));
       opened = unpooledConn->open();
       if (!opened) {
         unpooledConn.reset();
@@ -1958,7 +2186,7 @@ bool NetworkStore::open() {
   } else {
     if (useConnPool) {
       opened = g_connPool.open(remoteHost, remotePort,
-          static_cast<int>(timeout));
+          static_cast<int>(timeout), wireFormat);
     } else {
       // only open unpooled connection if not already open
       if (unpooledConn != NULL) {
@@ -1966,7 +2194,7 @@ bool NetworkStore::open() {
             " %s:%lu", remoteHost.c_str(), remotePort);
       }
       unpooledConn = shared_ptr<scribeConn>(new scribeConn(remoteHost,
-          remotePort, static_cast<int>(timeout)));
+          remotePort, static_cast<int>(timeout), wireFormat));
       opened = unpooledConn->open();
       if (!opened) {
         unpooledConn.reset();
@@ -1990,9 +2218,9 @@ void NetworkStore::close() {
   opened = false;
   if (useConnPool) {
     if (serviceBased) {
-      g_connPool.close(serviceName);
+      g_connPool.close(serviceName, wireFormat);
     } else {
-      g_connPool.close(remoteHost, remotePort);
+      g_connPool.close(remoteHost, remotePort, wireFormat);
     }
   } else {
     if (unpooledConn != NULL) {
@@ -2017,6 +2245,7 @@ shared_ptr<Store> NetworkStore::copy(const std::string &category) {
   store->remotePort = remotePort;
   store->serviceName = serviceName;
   store->newCategory = newCategory;
+  store->wireFormat = wireFormat;
 
   return copied;
 }
@@ -2039,10 +2268,18 @@ NetworkStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
   if (newCategory.size() > 0) {
       LOG_OPER("[%s] Setting new category %s",
               categoryHandled.c_str(), newCategory.c_str());
+      // Entries are shared with other stores, so send renamed copies
+      // instead of modifying them in place
+      boost::shared_ptr<logentry_vector_t> renamed(new logentry_vector_t);
+      renamed->reserve(messages->size());
       for (logentry_vector_t::iterator it = messages->begin();
               it != messages->end(); ++it) {
-          (*it)->category = newCategory;
+          boost::shared_ptr<LogEntry> entry(new LogEntry);
+          entry->category = newCategory;
+          entry->message = (*it)->message;
+          renamed->push_back(entry);
       }
+      messages = renamed;
   }
 
   bool tryDummySend = shouldSendDummy(messages);
@@ -2051,14 +2288,15 @@ NetworkStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
   if (useConnPool) {
     if (serviceBased) {
       if (!tryDummySend ||
-          ((ret = g_connPool.send(serviceName, dummymessages)) == CONN_OK)) {
-        ret = g_connPool.send(serviceName, messages);
+          ((ret = g_connPool.send(serviceName, dummymessages,
+                                  wireFormat)) == CONN_OK)) {
+        ret = g_connPool.send(serviceName, messages, wireFormat);
       }
     } else {
       if (!tryDummySend ||
-          (ret = g_connPool.send(remoteHost, remotePort, dummymessages)) ==
-          CONN_OK) {
-        ret = g_connPool.send(remoteHost, remotePort, messages);
+          (ret = g_connPool.send(remoteHost, remotePort, dummymessages,
+                                 wireFormat)) == CONN_OK) {
+        ret = g_connPool.send(remoteHost, remotePort, messages, wireFormat);
       }
     }
   } else if (unpooledConn) {
@@ -2564,7 +2802,7 @@ bool BucketStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages)
         for (logentry_vector_t::iterator iter = batch->begin();
              iter != batch->end();
              ++iter) {
-          logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
+          boost::shared_ptr<LogEntry> entry(new LogEntry);
           entry->category = (*iter)->category;
           entry->message = getMessageWithoutKey((*iter)->message);
           key_removed->push_back(entry);
@@ -30,6 +30,7 @@
 #include "common.h" // includes std libs, thrift, and stl typedefs
 #include "conf.h"
 #include "file.h"
+#include "CompressedFile.h"
 #include "conn_pool.h"
 #include "store_queue.h"
 #include "network_dynamic_config.h"
@@ -44,6 +45,14 @@ enum roll_period_t {
   ROLL_OTHER
 };
 
+// when file stores fdatasync() what they write, see sync_policy
+enum sync_policy_t {
+  SYNC_NONE,
+  SYNC_INTERVAL,
+  SYNC_BYTES,
+  SYNC_PER_BATCH
+};
+
 
 /*
  * Abstract class to define the interface for a store
@@ -131,6 +140,14 @@ class FileStoreBase : public Store {
   // directory
   virtual void printStats(struct tm* creation_time);
 
+  // Creates a file of fsType, wrapped in a CompressedFile if compression
+  // is set
+  boost::shared_ptr<FileInterface> createFile(const std::string& name,
+                                              bool framed);
+
+  // Adds what was compressed since the last call to the counters
+  void reportCompression();
+
   // Returns the number of bytes to pad to align to the specified block size
   unsigned long bytesToPad(unsigned long next_message_length,
                            unsigned long current_file_size,
@@ -165,6 +182,13 @@ class FileStoreBase : public Store {
   unsigned long rollHour;
   unsigned long rollMinute;
   std::string fsType;
+  unsigned long writeBufferSize; // 0 for the file type's default
+  bool fadvise;
+  sync_policy_t syncPolicy;
+  unsigned long syncIntervalMs;  // for SYNC_INTERVAL
+  unsigned long syncBytes;       // for SYNC_BYTES
+  frame_codec_t compression;
+  unsigned long compressionBlockSize;
   unsigned long chunkSize;
   bool writeMeta;
   bool writeCategory;
@@ -179,6 +203,12 @@ class FileStoreBase : public Store {
                                // depending on rollPeriod
   std::string currentFilename; // this isn't used to choose the next file name,
                                // we just need it for reporting
+  compression_stats_t compressionStats; // since the last report
+  compression_stats_t compressionTotal;
+  CounterHandle* bytesBeforeCompression;
+  CounterHandle* bytesAfterCompression;
+  CounterHandle* compressionRatio;       // 100 * before / after
+  long reportedCompressionRatio;
   unsigned long eventsWritten; // This is how many events this process has
                                // written to the currently open file. It is NOT
                                // necessarily the number of lines in the file
@@ -206,6 +236,7 @@ class FileStore : public FileStoreBase {
   void configure(pStoreConf configuration, pStoreConf parent);
   void close();
   void flush();
+  void periodicCheck();
 
   // Each read does its own open and close and gets the whole file.
   // This is separate from the write file, and not really a consistent
@@ -224,11 +255,19 @@ class FileStore : public FileStoreBase {
                      boost::shared_ptr<FileInterface> write_file =
                      boost::shared_ptr<FileInterface>());
 
+  // fdatasync()s writeFile if sync_policy says it is time, or always
+  bool syncDue();
+  bool syncFile();
+
   bool isBufferFile;
   bool addNewlines;
 
   // State
   boost::shared_ptr<FileInterface> writeFile;
+  unsigned long unsyncedBytes;   // written to writeFile since the last sync
+  unsigned long lastSync;        // msec
+  LatencyHistogram* syncTime;
+  CounterHandle* bytesSynced;
 
  private:
   // disallow copy, assignment, and empty construction
@@ -361,6 +400,9 @@ class BufferStore : public Store {
                                   // multiple max_queue_size with
                                   // buffer_bypass_max_ratio.
 
+  LatencyHistogram* replayTime;   // of sending a batch read from the
+                                  // secondary store to the primary
+
  private:
   // disallow copy, assignment, and empty construction
   BufferStore();
@@ -402,6 +444,7 @@ class NetworkStore : public Store {
   std::string serviceName;
   std::string serviceOptions;
   std::string newCategory;  // new category for a message
+  wire_format_t wireFormat; // protocol and compression to send with
   server_vector_t servers;
   unsigned long serviceCacheTimeout;
   time_t lastServiceCheck;
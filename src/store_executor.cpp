@@ -0,0 +1,195 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include "common.h"
+#include "scribe_server.h"
+#include "store_executor.h"
+
+using namespace std;
+
+struct executor_thread_t {
+  StoreExecutor* executor;
+  size_t index;
+};
+
+// index of the store thread running this, or -1 on any other thread
+static __thread long currentWorker = -1;
+
+static void* workerStatic(void* arg) {
+  executor_thread_t* thread = static_cast<executor_thread_t*>(arg);
+  StoreExecutor* executor = thread->executor;
+  size_t index = thread->index;
+  delete thread;
+  executor->workerMember(index);
+  return NULL;
+}
+
+static void* timerStatic(void* executor) {
+  static_cast<StoreExecutor*>(executor)->timerMember();
+  return NULL;
+}
+
+StoreExecutor::StoreExecutor(size_t num_threads)
+  : nextWorker(0) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  sem_init(&tasksAvailable, 0, 0);
+  pthread_mutex_init(&timerMutex, NULL);
+  pthread_condattr_t timer_attr;
+  pthread_condattr_init(&timer_attr);
+  pthread_condattr_setclock(&timer_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timerCond, &timer_attr);
+  pthread_condattr_destroy(&timer_attr);
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    worker_t* worker = new worker_t;
+    pthread_mutex_init(&worker->lock, NULL);
+    workers.push_back(worker);
+  }
+
+  // StoreQueues are never destroyed while they are queued, and the
+  // executor lives as long as the handler, so the threads are detached
+  pthread_t thread;
+  for (size_t i = 0; i < num_threads; ++i) {
+    executor_thread_t* arg = new executor_thread_t;
+    arg->executor = this;
+    arg->index = i;
+    if (pthread_create(&thread, NULL, workerStatic, arg) != 0) {
+      throw runtime_error("failed to create store thread");
+    }
+    pthread_detach(thread);
+  }
+  if (pthread_create(&thread, NULL, timerStatic, this) != 0) {
+    throw runtime_error("failed to create store timer thread");
+  }
+  pthread_detach(thread);
+
+  LOG_OPER("started <%lu> shared store threads", (unsigned long)num_threads);
+}
+
+void StoreExecutor::submit(StoreQueue* queue) {
+  size_t index = currentWorker >= 0 ?
+    (size_t)currentWorker :
+    __sync_fetch_and_add(&nextWorker, 1) % workers.size();
+
+  worker_t* worker = workers[index];
+  pthread_mutex_lock(&worker->lock);
+  worker->tasks[queue->getPriority()].push_back(queue);
+  pthread_mutex_unlock(&worker->lock);
+  sem_post(&tasksAvailable);
+}
+
+// Takes the oldest task of our own deque, so queues get their turn in
+// the order they were woken, or steals the newest task of another one,
+// looking at all deques of a priority class before the next lower one.
+StoreQueue* StoreExecutor::take(size_t index) {
+  StoreQueue* queue = NULL;
+  for (int priority = NUM_PRIORITIES - 1; priority >= 0 && !queue;
+       --priority) {
+    for (size_t i = 0; i < workers.size() && !queue; ++i) {
+      worker_t* worker = workers[(index + i) % workers.size()];
+      pthread_mutex_lock(&worker->lock);
+      deque<StoreQueue*>& tasks = worker->tasks[priority];
+      if (!tasks.empty()) {
+        if (i == 0) {
+          queue = tasks.front();
+          tasks.pop_front();
+        } else {
+          queue = tasks.back();
+          tasks.pop_back();
+        }
+      }
+      pthread_mutex_unlock(&worker->lock);
+    }
+  }
+  return queue;
+}
+
+void StoreExecutor::workerMember(size_t index) {
+  currentWorker = index;
+  while (true) {
+    while (sem_wait(&tasksAvailable) != 0) {
+      // interrupted, try again
+    }
+
+    // Every post is matched by a task that is already in a deque, so
+    // this only loops while another thread is taking one that was posted
+    // after ours.
+    StoreQueue* queue;
+    while (!(queue = take(index))) {
+      sched_yield();
+    }
+    queue->runTask();
+  }
+}
+
+void StoreExecutor::scheduleAt(StoreQueue* queue, unsigned long wake_at) {
+  pthread_mutex_lock(&timerMutex);
+  wake_map_t::iterator iter = wakeTimes.find(queue);
+  if (iter != wakeTimes.end()) {
+    timers.erase(make_pair(iter->second, queue));
+    iter->second = wake_at;
+  } else {
+    wakeTimes[queue] = wake_at;
+  }
+  timers.insert(make_pair(wake_at, queue));
+
+  // the timer thread only needs to know if this is the new earliest
+  if (timers.begin()->second == queue) {
+    pthread_cond_signal(&timerCond);
+  }
+  pthread_mutex_unlock(&timerMutex);
+}
+
+void StoreExecutor::cancel(StoreQueue* queue) {
+  pthread_mutex_lock(&timerMutex);
+  wake_map_t::iterator iter = wakeTimes.find(queue);
+  if (iter != wakeTimes.end()) {
+    timers.erase(make_pair(iter->second, queue));
+    wakeTimes.erase(iter);
+  }
+  pthread_mutex_unlock(&timerMutex);
+}
+
+void StoreExecutor::timerMember() {
+  pthread_mutex_lock(&timerMutex);
+  while (true) {
+    if (timers.empty()) {
+      pthread_cond_wait(&timerCond, &timerMutex);
+      continue;
+    }
+
+    unsigned long now = scribe::clock::monotonicInMsec();
+    timer_set_t::iterator first = timers.begin();
+    if (first->first > now) {
+      struct timespec abs_timeout;
+      abs_timeout.tv_sec = first->first / 1000;
+      abs_timeout.tv_nsec = (first->first % 1000) * 1000000;
+      pthread_cond_timedwait(&timerCond, &timerMutex, &abs_timeout);
+      continue;
+    }
+
+    // Scheduled while holding timerMutex, so that cancel() can't return
+    // while we are still using the queue
+    StoreQueue* queue = first->second;
+    wakeTimes.erase(queue);
+    timers.erase(first);
+    queue->schedule();
+  }
+}
@@ -0,0 +1,86 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_STORE_EXECUTOR_H
+#define SCRIBE_STORE_EXECUTOR_H
+
+#include "common.h"
+#include "store_queue.h"
+#include <deque>
+
+/*
+ * Fixed pool of store threads shared by all StoreQueues, used instead of
+ * a thread per StoreQueue when num_store_threads is set. A StoreQueue is
+ * submitted when it has work to do, either because a producer or a
+ * command woke it or because its timer from scheduleAt() fired.
+ * StoreQueue makes sure it is never submitted again while it is queued
+ * or running, so every store is still only used by one thread at a time.
+ *
+ * Each thread has its own deque for every priority class. Submitting from
+ * a store thread uses that thread's deques, other threads spread their
+ * submissions round robin. Idle threads steal from the other end of the
+ * other deques. Queues of a higher class are always taken first.
+ */
+class StoreExecutor {
+ public:
+  explicit StoreExecutor(size_t num_threads);
+
+  // run queue->runTask() on one of the store threads
+  void submit(StoreQueue* queue);
+
+  // submit queue at wake_at, in msec from scribe::clock::monotonicInMsec(),
+  // unless it is rescheduled before then
+  void scheduleAt(StoreQueue* queue, unsigned long wake_at);
+
+  // forget queue's timer, called once the queue has stopped
+  void cancel(StoreQueue* queue);
+
+  inline size_t getNumThreads() const {
+    return workers.size();
+  }
+
+  // these need to be public for the thread creation to get to them,
+  // but no one else should ever call them.
+  void workerMember(size_t index);
+  void timerMember();
+
+ private:
+  struct worker_t {
+    pthread_mutex_t lock;   // Must be held to read/modify tasks
+    std::deque<StoreQueue*> tasks[NUM_PRIORITIES];
+  };
+  typedef std::set<std::pair<unsigned long, StoreQueue*> > timer_set_t;
+  typedef std::map<StoreQueue*, unsigned long> wake_map_t;
+
+  StoreQueue* take(size_t index);
+
+  std::vector<worker_t*> workers;
+  sem_t tasksAvailable;            // number of tasks in all deques
+  volatile unsigned long nextWorker;
+
+  timer_set_t timers;              // earliest first
+  wake_map_t wakeTimes;            // the entry of each queue in timers
+  pthread_mutex_t timerMutex;      // Must be held to read/modify timers
+  pthread_cond_t timerCond;       // waits on CLOCK_MONOTONIC
+
+  // disallow copy and assignment
+  StoreExecutor(const StoreExecutor& rhs);
+  const StoreExecutor& operator=(const StoreExecutor& rhs);
+};
+
+#endif // SCRIBE_STORE_EXECUTOR_H
@@ -23,13 +23,26 @@
 
 #include "common.h"
 #include "scribe_server.h"
+#include "store_executor.h"
+
+#include <limits.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 
 using namespace std;
 using namespace boost;
 using namespace scribe::thrift;
 
 #define DEFAULT_TARGET_WRITE_SIZE  16384LL
-#define DEFAULT_MAX_WRITE_INTERVAL 1
+#define DEFAULT_MAX_WRITE_INTERVAL_MS 1000
+#define DEFAULT_SPILL_QUEUE_SIZE   16777216LL
+#define DEFAULT_MIN_RETRY_BACKOFF_MS 500
+#define DEFAULT_MAX_RETRY_BACKOFF_MS 30000
+#define DEFAULT_MIN_WRITE_SIZE     4096LL
+#define DEFAULT_MAX_WRITE_SIZE     4194304LL
+#define DEFAULT_TARGET_WRITE_LATENCY_MS 100
+#define DEFAULT_JOURNAL_SYNC_INTERVAL_MS 1000
 
 void* threadStatic(void *this_ptr) {
   StoreQueue *queue_ptr = (StoreQueue*)this_ptr;
@@ -38,17 +51,62 @@ void* threadStatic(void *this_ptr) {
 }
 
 StoreQueue::StoreQueue(const string& type, const string& category,
-                       unsigned check_period, bool is_model, bool multi_category)
-  : msgQueueSize(0),
-    hasWork(false),
+                       unsigned long check_period_ms, bool is_model,
+                       bool multi_category)
+  : msgBatches(NULL),
+    heldBatches(NULL),
+    heldBatchesTail(NULL),
+    failedSize(0),
+    retryAt(0),
+    retryBackoff(0),
+    retrySeed(0),
+    msgQueueSize(0),
+    overloaded(false),
+    memoryAccount(g_Handler->getMemoryBudget()),
+    spilling(false),
+    lastJournalSync(0),
+    batchesHeld(0),
+    batchesTaken(0),
+    batchesSealed(0),
+    hasWork(0),
+    wakeupFd(-1),
+    executor(NULL),
+    runState(RUN_IDLE),
+    lastPeriodicCheck(0),
+    lastHandleMessages(0),
+    storeOpened(false),
     stopping(false),
     isModel(is_model),
     multiCategory(multi_category),
     categoryHandled(category),
-    checkPeriod(check_period),
+    checkPeriod(check_period_ms),
     targetWriteSize(DEFAULT_TARGET_WRITE_SIZE),
-    maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL),
-    mustSucceed(true) {
+    maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL_MS),
+    mustSucceed(true),
+    minRetryBackoff(DEFAULT_MIN_RETRY_BACKOFF_MS),
+    maxRetryBackoff(DEFAULT_MAX_RETRY_BACKOFF_MS),
+    adaptiveWriteSize(false),
+    minWriteSize(DEFAULT_MIN_WRITE_SIZE),
+    maxWriteSize(DEFAULT_MAX_WRITE_SIZE),
+    targetWriteLatency(DEFAULT_TARGET_WRITE_LATENCY_MS),
+    reportedWriteSize(0),
+    priority(PRIORITY_NORMAL),
+    weight(1),
+    spillQueueSize(DEFAULT_SPILL_QUEUE_SIZE),
+    maxSpillSize(0),
+    journalSyncInterval(DEFAULT_JOURNAL_SYNC_INTERVAL_MS),
+    reservedQueueSize(0),
+    requeueCounter(NULL),
+    lostCounter(NULL),
+    spillCounter(NULL),
+    retryCounter(NULL),
+    retryBackoffCounter(NULL),
+    writeSizeCounter(NULL),
+    flushLatency(NULL),
+    queueWait(NULL),
+    batchSize(NULL),
+    handleTime(NULL),
+    flushTime(NULL) {
 
   store = Store::createStore(this, type, category,
                             false, multiCategory);
@@ -60,8 +118,28 @@ StoreQueue::StoreQueue(const string& type, const string& category,
 
 StoreQueue::StoreQueue(const boost::shared_ptr<StoreQueue> example,
                        const std::string &category)
-  : msgQueueSize(0),
-    hasWork(false),
+  : msgBatches(NULL),
+    heldBatches(NULL),
+    heldBatchesTail(NULL),
+    failedSize(0),
+    retryAt(0),
+    retryBackoff(0),
+    retrySeed(0),
+    msgQueueSize(0),
+    overloaded(false),
+    memoryAccount(g_Handler->getMemoryBudget()),
+    spilling(false),
+    lastJournalSync(0),
+    batchesHeld(0),
+    batchesTaken(0),
+    batchesSealed(0),
+    hasWork(0),
+    wakeupFd(-1),
+    executor(NULL),
+    runState(RUN_IDLE),
+    lastPeriodicCheck(0),
+    lastHandleMessages(0),
+    storeOpened(false),
     stopping(false),
     isModel(false),
     multiCategory(example->multiCategory),
@@ -69,7 +147,34 @@ StoreQueue::StoreQueue(const boost::shared_ptr<StoreQueue> example,
     checkPeriod(example->checkPeriod),
     targetWriteSize(example->targetWriteSize),
     maxWriteInterval(example->maxWriteInterval),
-    mustSucceed(example->mustSucceed) {
+    mustSucceed(example->mustSucceed),
+    minRetryBackoff(example->minRetryBackoff),
+    maxRetryBackoff(example->maxRetryBackoff),
+    adaptiveWriteSize(example->adaptiveWriteSize),
+    minWriteSize(example->minWriteSize),
+    maxWriteSize(example->maxWriteSize),
+    targetWriteLatency(example->targetWriteLatency),
+    reportedWriteSize(0),
+    rateLimit(example->rateLimit.getRate(), example->rateLimit.getBurst()),
+    priority(example->priority),
+    weight(example->weight),
+    spillPath(example->spillPath),
+    spillQueueSize(example->spillQueueSize),
+    maxSpillSize(example->maxSpillSize),
+    journalPath(example->journalPath),
+    journalSyncInterval(example->journalSyncInterval),
+    reservedQueueSize(example->reservedQueueSize),
+    requeueCounter(NULL),
+    lostCounter(NULL),
+    spillCounter(NULL),
+    retryCounter(NULL),
+    retryBackoffCounter(NULL),
+    writeSizeCounter(NULL),
+    flushLatency(NULL),
+    queueWait(NULL),
+    batchSize(NULL),
+    handleTime(NULL),
+    flushTime(NULL) {
 
   store = example->copyStore(category);
   if (!store) {
@@ -81,40 +186,342 @@ StoreQueue::StoreQueue(const boost::shared_ptr<StoreQueue> example,
 
 StoreQueue::~StoreQueue() {
   if (!isModel) {
+    while (msgBatches) {
+      msg_batch_t* next = msgBatches->next;
+      delete msgBatches;
+      msgBatches = next;
+    }
+    while (heldBatches) {
+      msg_batch_t* next = heldBatches->next;
+      delete heldBatches;
+      heldBatches = next;
+    }
     pthread_mutex_destroy(&cmdMutex);
-    pthread_mutex_destroy(&msgMutex);
-    pthread_mutex_destroy(&hasWorkMutex);
-    pthread_cond_destroy(&hasWorkCond);
+    pthread_mutex_destroy(&overloadMutex);
+    pthread_mutex_destroy(&spillMutex);
+    if (executor) {
+      sem_destroy(&stoppedSem);
+    } else if (wakeupFd >= 0) {
+      ::close(wakeupFd);
+    }
   }
 }
 
-void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
+void StoreQueue::addMessage(logentry_ptr_t entry) {
   if (isModel) {
     LOG_OPER("ERROR: called addMessage on model store");
   } else {
-    bool waitForWork = false;
-
-    pthread_mutex_lock(&msgMutex);
-    msgQueue->push_back(entry);
-    msgQueueSize += entry->message.size();
-
-    waitForWork = (msgQueueSize >= targetWriteSize) ? true : false;
-    pthread_mutex_unlock(&msgMutex);
-
-    // Wake up store thread if we have enough messages
-    if (waitForWork == true) {
-      // signal that there is work to do if not already signaled
-      pthread_mutex_lock(&hasWorkMutex);
-      if (!hasWork) {
-        hasWork = true;
-        pthread_cond_signal(&hasWorkCond);
-      }
-      pthread_mutex_unlock(&hasWorkMutex);
+    msg_batch_t* batch = new msg_batch_t;
+    batch->first = entry;
+    batch->size = entry->message.size();
+    pushBatch(batch);
+  }
+}
+
+void StoreQueue::addMessages(const logentry_vector_t& entries) {
+  if (isModel) {
+    LOG_OPER("ERROR: called addMessages on model store");
+  } else if (!entries.empty()) {
+    msg_batch_t* batch = new msg_batch_t;
+    batch->first = entries.front();
+    batch->rest.assign(entries.begin() + 1, entries.end());
+    batch->size = 0;
+    for (logentry_vector_t::const_iterator iter = entries.begin();
+         iter != entries.end();
+         ++iter) {
+      batch->size += (*iter)->message.size();
+    }
+    pushBatch(batch);
+  }
+}
+
+// journaled is set for batches read back from the journal, which are
+// still in it.
+void StoreQueue::pushBatch(msg_batch_t* batch, bool journaled) {
+  batch->enqueueTime = scribe::clock::monotonicInMsec();
+
+  if (spillFile &&
+      (spilling || msgQueueSize + batch->size > spillQueueSize) &&
+      spillBatch(batch)) {
+    delete batch;
+    if (!retryAt) {
+      signalWork();
+    }
+    return;
+  }
+
+  // Encoded before the batch is pushed, since the store thread may take
+  // and delete it right after. It is appended after it is pushed, so
+  // that it can't go to a segment the store thread has sealed before
+  // taking it.
+  string record;
+  if (journal && !journaled) {
+    Journal::encode(record, batch->first, batch->rest);
+  }
+  unsigned long long batch_size = batch->size;
+
+  // The store thread only ever takes the whole list, so there is no ABA
+  // problem in swapping the head.
+  msg_batch_t* head = msgBatches;
+  while (true) {
+    batch->next = head;
+    msg_batch_t* prev = __sync_val_compare_and_swap(&msgBatches, head, batch);
+    if (prev == head) {
+      break;
+    }
+    head = prev;
+  }
+
+  if (!record.empty()) {
+    journal->append(record);
+  }
+
+  memoryAccount.add(batch_size);
+  unsigned long long size = __sync_add_and_fetch(&msgQueueSize, batch_size);
+  updateOverloaded();
+
+  // Wake up store thread if we have enough messages, unless it is
+  // backing off after a failure
+  if (size >= targetWriteSize && !retryAt) {
+    signalWork();
+  }
+}
+
+bool StoreQueue::admit(unsigned long long bytes) {
+  if (spillFile && (spilling || msgQueueSize + bytes > spillQueueSize)) {
+    return true;
+  }
+  return memoryAccount.admit(bytes);
+}
+
+// Appends batch to spillFile. Returns false if it has to stay in memory
+// because the spill file is full or can't be written.
+bool StoreQueue::spillBatch(msg_batch_t* batch) {
+  logentry_vector_t entries;
+  entries.reserve(1 + batch->rest.size());
+  entries.push_back(batch->first);
+  entries.insert(entries.end(), batch->rest.begin(), batch->rest.end());
+
+  bool spilled = false;
+  pthread_mutex_lock(&spillMutex);
+  if (maxSpillSize == 0 || spillFile->size() < maxSpillSize) {
+    spilled = spillFile->append(entries, batch->enqueueTime);
+    if (spilled) {
+      spilling = true;
     }
   }
+  pthread_mutex_unlock(&spillMutex);
+
+  if (spilled) {
+    spillCounter->add(entries.size());
+  }
+  return spilled;
+}
+
+// Reads about targetWriteSize bytes of messages back from spillFile, and
+// deletes the file once it has all been read. Adds their size to size.
+// Must only be called by the store thread.
+shared_ptr<logentry_vector_t>
+StoreQueue::readSpill(batch_times_t& batch_times, unsigned long long& size) {
+  shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+
+  size_t first_batch = batch_times.size();
+  pthread_mutex_lock(&spillMutex);
+  bool ok = spillFile->read(targetWriteSize, *messages, batch_times);
+  if (journal && !messages->empty()) {
+    // the spill file may be gone before they are handled
+    string record;
+    Journal::encode(record, *messages);
+    journal->append(record);
+  }
+  if (!ok) {
+    LOG_OPER("[%s] dropping the rest of spill file <%s>",
+             categoryHandled.c_str(), spillFile->getFilename().c_str());
+    spillFile->reset();
+    spilling = false;
+  } else if (spillFile->empty()) {
+    // caught up, new batches can go to memory again
+    spillFile->reset();
+    spilling = false;
+  }
+  pthread_mutex_unlock(&spillMutex);
+
+  if (messages->empty()) {
+    messages.reset();
+    return messages;
+  }
+
+  // spilled by a previous run if it is in the future
+  unsigned long now = scribe::clock::monotonicInMsec();
+  for (size_t i = first_batch; i < batch_times.size(); ++i) {
+    queueWait->add(now > batch_times[i].first ? now - batch_times[i].first : 0,
+                   batch_times[i].second);
+  }
+
+  unsigned long long read_size = 0;
+  for (logentry_vector_t::iterator iter = messages->begin();
+       iter != messages->end();
+       ++iter) {
+    read_size += (*iter)->message.size();
+  }
+  memoryAccount.add(read_size);
+  size += read_size;
+  return messages;
+}
+
+// Moves the batches pushed onto msgBatches to the end of heldBatches,
+// oldest first.
+// Must only be called by the store thread.
+void StoreQueue::holdBatches() {
+  // Sealed first, so that every batch in the sealed segment was pushed
+  // before the swap below and is held by now.
+  bool sealed = journal && journal->seal();
+  msg_batch_t* batch = __sync_lock_test_and_set(&msgBatches,
+                                                (msg_batch_t*)NULL);
+  msg_batch_t* oldest = NULL;
+  msg_batch_t* newest = batch;
+  while (batch) {
+    msg_batch_t* next = batch->next;
+    batch->next = oldest;
+    oldest = batch;
+    batch = next;
+    ++batchesHeld;
+  }
+  if (oldest) {
+    if (heldBatchesTail) {
+      heldBatchesTail->next = oldest;
+    } else {
+      heldBatches = oldest;
+    }
+    heldBatchesTail = newest;
+  }
+  if (sealed) {
+    batchesSealed = batchesHeld;
+  }
+}
+
+// Takes queued batches, oldest first, until at least max_size bytes have
+// been taken, and appends their messages to messages, their enqueue
+// times to batch_times and their size to size. Batches that weren't taken
+// are held for the next call.
+// Must only be called by the store thread.
+void StoreQueue::takeMessages(logentry_vector_t& messages,
+                              batch_times_t& batch_times,
+                              unsigned long long& size,
+                              unsigned long long max_size) {
+  holdBatches();
+
+  msg_batch_t* batch;
+  size_t count = 0;
+  unsigned long long taken = 0;
+  for (batch = heldBatches; batch && taken < max_size; batch = batch->next) {
+    count += 1 + batch->rest.size();
+    taken += batch->size;
+  }
+  messages.reserve(messages.size() + count);
+
+  unsigned long now = scribe::clock::monotonicInMsec();
+  taken = 0;
+  while (heldBatches && taken < max_size) {
+    batch = heldBatches;
+    queueWait->add(now - batch->enqueueTime, 1 + batch->rest.size());
+    heldBatches = batch->next;
+    messages.push_back(batch->first);
+    messages.insert(messages.end(), batch->rest.begin(), batch->rest.end());
+    batch_times.push_back(make_pair(batch->enqueueTime,
+                                    1 + batch->rest.size()));
+    taken += batch->size;
+    ++batchesTaken;
+    delete batch;
+  }
+  if (!heldBatches) {
+    heldBatchesTail = NULL;
+  }
+
+  __sync_sub_and_fetch(&msgQueueSize, taken);
+  updateOverloaded();
+  size += taken;
+}
+
+// signal that there is work to do if not already signaled
+void StoreQueue::signalWork() {
+  if (__sync_bool_compare_and_swap(&hasWork, 0, 1)) {
+    if (executor) {
+      schedule();
+      return;
+    }
+    uint64_t one = 1;
+    if (write(wakeupFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      LOG_OPER("[%s] failed to wake up store thread: %s",
+               categoryHandled.c_str(), strerror(errno));
+    }
+  }
+}
+
+// wait until there's some work to do or wake_at has passed
+void StoreQueue::waitForWork(unsigned long wake_at) {
+  if (!hasWork) {
+    unsigned long now = scribe::clock::monotonicInMsec();
+    struct pollfd wakeup;
+    wakeup.fd = wakeupFd;
+    wakeup.events = POLLIN;
+    wakeup.revents = 0;
+    poll(&wakeup, 1, wake_at > now ? (int)(wake_at - now) : 0);
+  }
+
+  uint64_t count;
+  if (read(wakeupFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG_OPER("[%s] failed to read store thread wakeup: %s",
+             categoryHandled.c_str(), strerror(errno));
+  }
+  // full barrier, so that the queue is looked at again after this
+  __sync_fetch_and_and(&hasWork, 0);
 }
 
 void StoreQueue::configureAndOpen(pStoreConf configuration) {
+  // Set up the rate limit right away rather than on the store thread, so
+  // that it is in place before Log() can route messages to this queue.
+  unsigned long max_msg_per_second = 0;
+  unsigned long max_msg_burst = 0;
+  configuration->getUnsigned("max_msg_per_second", max_msg_per_second);
+  configuration->getUnsigned("max_msg_burst", max_msg_burst);
+  rateLimit.configure(max_msg_per_second, max_msg_burst);
+
+  // Log() and the store threads look at these before the store is
+  // configured
+  string priority_name;
+  if (configuration->getString("priority", priority_name)) {
+    if (priority_name == "low") {
+      priority = PRIORITY_LOW;
+    } else if (priority_name == "high") {
+      priority = PRIORITY_HIGH;
+    } else {
+      if (priority_name != "normal") {
+        LOG_OPER("[%s] unknown priority <%s>, using normal",
+                 categoryHandled.c_str(), priority_name.c_str());
+      }
+      priority = PRIORITY_NORMAL;
+    }
+  }
+  if (configuration->getUnsigned("weight", weight) && weight == 0) {
+    weight = 1;
+  }
+
+  // Likewise spilling, since Log() threads do the spilling
+  configuration->getString("spill_path", spillPath);
+  configuration->getUnsignedLongLong("spill_queue_size", spillQueueSize);
+  configuration->getUnsignedLongLong("max_spill_size", maxSpillSize);
+  configuration->getUnsignedLongLong("reserved_queue_size", reservedQueueSize);
+
+  // and journaling, which has to replay before Log() can add messages
+  configuration->getString("journal_path", journalPath);
+  configuration->getUnsigned("journal_sync_interval_ms", journalSyncInterval);
+  if (!isModel) {
+    openSpill();
+    openJournal();
+    memoryAccount.setReservation(reservedQueueSize);
+  }
+
   // model store has to handle this inline since it has no queue
   if (isModel) {
     configureInline(configuration);
@@ -124,13 +531,7 @@ void StoreQueue::configureAndOpen(pStoreConf configuration) {
     cmdQueue.push(cmd);
     pthread_mutex_unlock(&cmdMutex);
 
-    // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
-    pthread_mutex_unlock(&hasWorkMutex);
+    signalWork();
   }
 }
 
@@ -144,15 +545,15 @@ void StoreQueue::stop() {
     stopping = true;
     pthread_mutex_unlock(&cmdMutex);
 
-    // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
-    pthread_mutex_unlock(&hasWorkMutex);
+    signalWork();
 
-    pthread_join(storeThread, NULL);
+    if (executor) {
+      while (sem_wait(&stoppedSem) != 0) {
+        // interrupted, try again
+      }
+    } else {
+      pthread_join(storeThread, NULL);
+    }
   }
 }
 
@@ -165,13 +566,7 @@ void StoreQueue::open() {
     cmdQueue.push(cmd);
     pthread_mutex_unlock(&cmdMutex);
 
-    // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
-    pthread_mutex_unlock(&hasWorkMutex);
+    signalWork();
   }
 }
 
@@ -204,150 +599,559 @@ void StoreQueue::threadMember() {
     return;
   }
 
-  // init time of last periodic check to time of 0
-  time_t last_periodic_check = 0;
+  unsigned long wake_at;
+  while (!runOnce(wake_at)) {
+    waitForWork(wake_at);
+  }
+}
+
+void StoreQueue::schedule() {
+  while (true) {
+    int state = runState;
+    int next;
+    if (state == RUN_IDLE) {
+      next = RUN_QUEUED;
+    } else if (state == RUN_RUNNING) {
+      next = RUN_RERUN;
+    } else {
+      // already queued, will run again or has stopped
+      return;
+    }
+    if (__sync_bool_compare_and_swap(&runState, state, next)) {
+      if (next == RUN_QUEUED) {
+        executor->submit(this);
+      }
+      return;
+    }
+  }
+}
+
+void StoreQueue::runTask() {
+  runState = RUN_RUNNING;
+  // full barrier, so that anything signaled after this gets another run
+  __sync_fetch_and_and(&hasWork, 0);
 
-  time_t last_handle_messages;
-  time(&last_handle_messages);
+  unsigned long wake_at;
+  if (runOnce(wake_at)) {
+    runState = RUN_STOPPED;
+    executor->cancel(this);
+    // stop() may delete us as soon as this is posted
+    sem_post(&stoppedSem);
+    return;
+  }
 
-  struct timespec abs_timeout;
+  if (wake_at <= scribe::clock::monotonicInMsec()) {
+    // more to do right away, get back in line behind the other queues
+    runState = RUN_QUEUED;
+    executor->submit(this);
+    return;
+  }
 
+  executor->scheduleAt(this, wake_at);
+  if (!__sync_bool_compare_and_swap(&runState, RUN_RUNNING, RUN_IDLE)) {
+    // woken while we were running
+    runState = RUN_QUEUED;
+    executor->submit(this);
+  }
+}
+
+// Handles commands, periodic checks and messages that are due, and sets
+// wake_at to when this needs to run again. Returns true once the queue
+// has been stopped and the store closed.
+bool StoreQueue::runOnce(unsigned long& wake_at) {
   bool stop = false;
-  bool open = false;
-  while (!stop) {
 
-    // handle commands
-    //
-    pthread_mutex_lock(&cmdMutex);
-    while (!cmdQueue.empty()) {
-      StoreCommand cmd = cmdQueue.front();
-      cmdQueue.pop();
-
-      switch (cmd.command) {
-      case CMD_CONFIGURE:
-        configureInline(cmd.configuration);
-        openInline();
-        open = true;
-        break;
-      case CMD_OPEN:
-        openInline();
-        open = true;
-        break;
-      case CMD_STOP:
-        stop = true;
-        break;
-      default:
-        LOG_OPER("LOGIC ERROR: unknown command to store queue");
-        break;
-      }
-    }
+  // handle commands
+  //
+  pthread_mutex_lock(&cmdMutex);
+  while (!cmdQueue.empty()) {
+    StoreCommand cmd = cmdQueue.front();
+    cmdQueue.pop();
 
-    // handle periodic tasks
-    time_t this_loop;
-    time(&this_loop);
-    if (!stop && ((this_loop - last_periodic_check) >= checkPeriod)) {
-      if (open) store->periodicCheck();
-      last_periodic_check = this_loop;
+    switch (cmd.command) {
+    case CMD_CONFIGURE:
+      configureInline(cmd.configuration);
+      openInline();
+      storeOpened = true;
+      applyThreadPriority();
+      break;
+    case CMD_OPEN:
+      openInline();
+      storeOpened = true;
+      applyThreadPriority();
+      break;
+    case CMD_STOP:
+      stop = true;
+      break;
+    default:
+      LOG_OPER("LOGIC ERROR: unknown command to store queue");
+      break;
     }
+  }
 
-    pthread_mutex_lock(&msgMutex);
-    pthread_mutex_unlock(&cmdMutex);
+  // handle periodic tasks
+  unsigned long this_loop = scribe::clock::monotonicInMsec();
+  if (!stop && ((this_loop - lastPeriodicCheck) >= checkPeriod)) {
+    if (storeOpened) store->periodicCheck();
+    lastPeriodicCheck = this_loop;
+  }
+
+  pthread_mutex_unlock(&cmdMutex);
+
+  boost::shared_ptr<logentry_vector_t> messages;
+  batch_times_t batch_times;
+  unsigned long long size = 0;
+
+  // handle messages if stopping, enough time has passed, or queue is large.
+  // Failed messages are retried, together with what has been queued
+  // since, once their backoff has passed. Messages read back from a
+  // journal or spill file wait for the store to be opened.
+  //
+  bool handle;
+  if (!storeOpened && !stop) {
+    handle = false;
+  } else if (failedMessages) {
+    handle = stop || this_loop >= retryAt;
+  } else {
+    handle = stop ||
+      (this_loop - lastHandleMessages >= maxWriteInterval) ||
+      msgQueueSize >= targetWriteSize ||
+      spilling;
+  }
 
-    boost::shared_ptr<logentry_vector_t> messages;
-
-    // handle messages if stopping, enough time has passed, or queue is large
-    //
-    if (stop ||
-        (this_loop - last_handle_messages >= maxWriteInterval) ||
-        msgQueueSize >= targetWriteSize) {
-
-      if (failedMessages) {
-        // process any messages we were not able to process last time
-        messages = failedMessages;
-        failedMessages = boost::shared_ptr<logentry_vector_t>();
-      } else if (msgQueueSize > 0) {
-        // process message in queue
-        messages = msgQueue;
-        msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
-        msgQueueSize = 0;
+  if (handle) {
+    if (failedMessages) {
+      // process any messages we were not able to process last time
+      messages = failedMessages;
+      failedMessages = boost::shared_ptr<logentry_vector_t>();
+      batch_times.swap(failedBatchTimes);
+      size = failedSize;
+      failedSize = 0;
+      retryCounter->inc();
+
+      // and as many queued ones as fit in a write, so that the retry
+      // that succeeds drains the most. Stopping takes everything.
+      if (stop) {
+        takeMessages(*messages, batch_times, size, ULLONG_MAX);
+      } else if (size < targetWriteSize && (heldBatches || msgBatches)) {
+        takeMessages(*messages, batch_times, size, targetWriteSize - size);
+      }
+    } else if (heldBatches || msgBatches) {
+      // process message in queue
+      // Shared store threads write at most weight writes per pass, so
+      // that a backlogged queue gives others a turn. Stopping is the
+      // last pass, so it takes everything.
+      unsigned long long max_size = ULLONG_MAX;
+      if (adaptiveWriteSize && !stop) {
+        max_size = targetWriteSize;
+      }
+      if (executor && !stop) {
+        max_size = min(max_size, weight * targetWriteSize);
       }
+      messages = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
+      takeMessages(*messages, batch_times, size, max_size);
+    } else if (spilling && !stop) {
+      // memory is drained, catch up on what was spilled. The rest is
+      // left on disk for the next start when stopping.
+      messages = readSpill(batch_times, size);
+    }
+
+    // reset timer
+    lastHandleMessages = this_loop;
+  }
 
-      // reset timer
-      last_handle_messages = this_loop;
+  if (messages) {
+    batchSize->add(messages->size());
+    unsigned long start = scribe::clock::monotonicInMsec();
+    bool handled = store->handleMessages(messages);
+    unsigned long handled_at = scribe::clock::monotonicInMsec();
+    handleTime->add(handled_at - start);
+    if (!handled) {
+      // Store could not handle these messages
+      processFailedMessages(messages, batch_times, size);
     }
+    store->flush();
 
-    pthread_mutex_unlock(&msgMutex);
+    unsigned long now = scribe::clock::monotonicInMsec();
+    flushTime->add(now - handled_at);
+    if (adaptiveWriteSize) {
+      adaptWriteSize(handled, size, now - start);
+    }
 
-    if (messages) {
-      if (!store->handleMessages(messages)) {
-        // Store could not handle these messages
-        processFailedMessages(messages);
+    if (handled) {
+      retryAt = 0;
+      retryBackoff = 0;
+      memoryAccount.add(-(long long)size);
+      for (batch_times_t::iterator iter = batch_times.begin();
+           iter != batch_times.end();
+           ++iter) {
+        // spilled by a previous run if it is in the future
+        flushLatency->add(now > iter->first ? now - iter->first : 0,
+                          iter->second);
       }
-      store->flush();
     }
+  }
 
-    if (!stop) {
-      // set timeout to when we need to handle messages or do a periodic check
-      abs_timeout.tv_sec = min(last_periodic_check + checkPeriod,
-          last_handle_messages + maxWriteInterval);
-      abs_timeout.tv_nsec = 0;
-
-      // wait until there's some work to do or we timeout
-      pthread_mutex_lock(&hasWorkMutex);
-      if (!hasWork) {
-	pthread_cond_timedwait(&hasWorkCond, &hasWorkMutex, &abs_timeout);
+  if (journal) {
+    // Nothing can be queued once stopping, so with everything handled the
+    // journal can go. Otherwise the sealed segment can go once the batches
+    // held when it was sealed are taken and handled, however many were
+    // queued after them. With nothing queued, sealing again lets the
+    // active segment go too.
+    if (stop) {
+      if (!failedMessages && !heldBatches && !msgBatches) {
+        journal->reset();
+      }
+    } else if (!failedMessages) {
+      if (!heldBatches && !msgBatches) {
+        holdBatches();
+      }
+      if (batchesTaken >= batchesSealed) {
+        journal->release();
       }
-      hasWork = false;
-      pthread_mutex_unlock(&hasWorkMutex);
     }
 
-  } // while (!stop)
+    unsigned long now = scribe::clock::monotonicInMsec();
+    if (stop || (journalSyncInterval &&
+                 now - lastJournalSync >= journalSyncInterval)) {
+      journal->sync();
+      lastJournalSync = now;
+    }
+  }
+
+  if (stop) {
+    store->close();
+    if (spillFile) {
+      pthread_mutex_lock(&spillMutex);
+      spillFile->close();
+      pthread_mutex_unlock(&spillMutex);
+    }
+    leaveHandler();
+    return true;
+  }
 
-  store->close();
+  // when we need to handle messages or do a periodic check
+  if (failedMessages) {
+    wake_at = min(lastPeriodicCheck + checkPeriod, (unsigned long)retryAt);
+  } else if (storeOpened && (spilling || msgQueueSize >= targetWriteSize)) {
+    // keep reading the spill file back, or catch up after retries
+    wake_at = this_loop;
+  } else {
+    wake_at = min(lastPeriodicCheck + checkPeriod,
+                  lastHandleMessages + maxWriteInterval);
+  }
+  if (journal && journalSyncInterval) {
+    wake_at = min(wake_at, lastJournalSync + journalSyncInterval);
+  }
+  return false;
 }
 
-void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages) {
+void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages,
+                                       batch_times_t& batch_times,
+                                       unsigned long long size) {
   // If the store was not able to process these messages, we will either
   // requeue them or give up depending on the value of mustSucceed
 
   if (mustSucceed) {
-    // Save failed messages
+    // Save failed messages, their latency counts from when they were
+    // first queued
     failedMessages = messages;
+    failedBatchTimes.swap(batch_times);
+
+    // the store may have handled some of them
+    failedSize = 0;
+    for (logentry_vector_t::iterator iter = messages->begin();
+         iter != messages->end();
+         ++iter) {
+      failedSize += (*iter)->message.size();
+    }
+    memoryAccount.add((long long)failedSize - (long long)size);
+
+    // back off for somewhere between half and all of the backoff, so
+    // that queues failing together don't all retry together
+    retryBackoff = retryBackoff ? min(retryBackoff * 2, maxRetryBackoff)
+                                : minRetryBackoff;
+    unsigned long delay = retryBackoff / 2 +
+                          rand_r(&retrySeed) % (retryBackoff / 2 + 1);
+    retryAt = scribe::clock::monotonicInMsec() + delay;
+    retryBackoffCounter->add(delay);
 
     LOG_OPER("[%s] WARNING: Re-queueing %lu messages!",
              categoryHandled.c_str(), messages->size());
-    g_Handler->incCounter(categoryHandled, "requeue", messages->size());
+    requeueCounter->add(messages->size());
   } else {
     // record messages as being lost
     LOG_OPER("[%s] WARNING: Lost %lu messages!",
              categoryHandled.c_str(), messages->size());
-    g_Handler->incCounter(categoryHandled, "lost", messages->size());
+    lostCounter->add(messages->size());
+    memoryAccount.add(-(long long)size);
+  }
+}
+
+// AIMD tuning of targetWriteSize after a write of size bytes that took
+// msec. Only full writes grow it, since a larger target wouldn't have
+// changed anything for the others.
+void StoreQueue::adaptWriteSize(bool handled, unsigned long long size,
+                                unsigned long msec) {
+  unsigned long long target = targetWriteSize;
+  if (!handled || msec > targetWriteLatency) {
+    target = max(target / 2, minWriteSize);
+  } else if (size >= target) {
+    target = min(target + minWriteSize, maxWriteSize);
+  }
+  if (target != targetWriteSize) {
+    targetWriteSize = target;
+    reportWriteSize();
+  }
+}
+
+// Makes writeSizeCounter show targetWriteSize. The overall counter is
+// the sum over all adaptive queues.
+void StoreQueue::reportWriteSize() {
+  long long target = adaptiveWriteSize ? targetWriteSize : 0;
+  writeSizeCounter->add(target - reportedWriteSize);
+  reportedWriteSize = target;
+}
+
+// Lets the kernel favour the store threads of more important categories
+// for CPU and disk. Shared store threads run queues of all priorities, so
+// there the executor favours them instead. Raising the priority needs
+// CAP_SYS_NICE.
+void StoreQueue::applyThreadPriority() {
+  if (executor || priority == PRIORITY_NORMAL) {
+    return;
+  }
+
+  // nice values, and best effort I/O priority levels, 4 being the default
+  static const int nice_values[NUM_PRIORITIES] = {10, 0, -5};
+  static const int io_levels[NUM_PRIORITIES] = {7, 4, 0};
+  static const int IOPRIO_WHO_PROCESS = 1;
+  static const int IOPRIO_CLASS_BE = 2;
+  static const int IOPRIO_CLASS_SHIFT = 13;
+
+  pid_t tid = syscall(SYS_gettid);
+  if (setpriority(PRIO_PROCESS, tid, nice_values[priority]) != 0) {
+    LOG_OPER("[%s] failed to set store thread nice value: %s",
+             categoryHandled.c_str(), strerror(errno));
+  }
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+              (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) |
+              io_levels[priority]) != 0) {
+    LOG_OPER("[%s] failed to set store thread I/O priority: %s",
+             categoryHandled.c_str(), strerror(errno));
   }
 }
 
+// Tells the handler when msgQueueSize crosses max_queue_size times weight,
+// so that throttling doesn't need to look at every queue.
+// Only takes overloadMutex when the state looks like it changed, and
+// looks again under the lock so that racing callers agree.
+void StoreQueue::updateOverloaded() {
+  bool over = msgQueueSize > g_Handler->getMaxQueueSize() * weight;
+  if (over == overloaded) {
+    return;
+  }
+  pthread_mutex_lock(&overloadMutex);
+  over = msgQueueSize > g_Handler->getMaxQueueSize() * weight;
+  if (over != overloaded) {
+    overloaded = over;
+    g_Handler->setQueueOverloaded(this, over);
+  }
+  pthread_mutex_unlock(&overloadMutex);
+}
+
+// Takes this queue out of the handler's overloaded queues, memory budget
+// and overall target write size once it has stopped. The queue may be
+// deleted after the handler is gone, so its destructor can't do this.
+void StoreQueue::leaveHandler() {
+  pthread_mutex_lock(&overloadMutex);
+  if (overloaded) {
+    overloaded = false;
+    g_Handler->setQueueOverloaded(this, false);
+  }
+  pthread_mutex_unlock(&overloadMutex);
+
+  memoryAccount.clear();
+  writeSizeCounter->add(-reportedWriteSize);
+  reportedWriteSize = 0;
+}
+
 void StoreQueue::storeInitCommon() {
   // model store doesn't need this stuff
   if (!isModel) {
-    msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
+    requeueCounter = g_Handler->getCounterHandle(categoryHandled, "requeue");
+    lostCounter = g_Handler->getCounterHandle(categoryHandled, "lost");
+    spillCounter = g_Handler->getCounterHandle(categoryHandled, "spilled");
+    retryCounter = g_Handler->getCounterHandle(categoryHandled, "retries");
+    retryBackoffCounter = g_Handler->getCounterHandle(categoryHandled,
+                                                      "retry backoff ms");
+    retrySeed = time(NULL) ^ (unsigned long)this;
+    writeSizeCounter = g_Handler->getCounterHandle(categoryHandled,
+                                                   "target write size");
+    flushLatency = g_Handler->getLatencyHistogram(categoryHandled,
+                                                  "flush latency ms");
+    queueWait = g_Handler->getLatencyHistogram(categoryHandled,
+                                               "queue wait ms");
+    batchSize = g_Handler->getLatencyHistogram(categoryHandled,
+                                               "batch size");
+    handleTime = g_Handler->getLatencyHistogram(categoryHandled, "handle ms");
+    flushTime = g_Handler->getLatencyHistogram(categoryHandled, "flush ms");
+    reportWriteSize();
     pthread_mutex_init(&cmdMutex, NULL);
-    pthread_mutex_init(&msgMutex, NULL);
-    pthread_mutex_init(&hasWorkMutex, NULL);
-    pthread_cond_init(&hasWorkCond, NULL);
+    pthread_mutex_init(&overloadMutex, NULL);
+    pthread_mutex_init(&spillMutex, NULL);
+    lastHandleMessages = scribe::clock::monotonicInMsec();
 
-    pthread_create(&storeThread, NULL, threadStatic, (void*) this);
+    executor = g_Handler->getStoreExecutor();
+    if (executor) {
+      // first runs when configureAndOpen() or open() queues a command
+      sem_init(&stoppedSem, 0, 0);
+    } else {
+      wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (wakeupFd < 0) {
+        throw std::runtime_error("eventfd failed in StoreQueue: " +
+                                 string(strerror(errno)));
+      }
+
+      pthread_create(&storeThread, NULL, threadStatic, (void*) this);
+    }
+
+    // copies of a model store get these from it
+    openSpill();
+    openJournal();
+    memoryAccount.setReservation(reservedQueueSize);
+  }
+}
+
+// Opens spillFile if spill_path is set, picking up whatever a previous run
+// left in it.
+void StoreQueue::openSpill() {
+  if (spillPath.empty()) {
+    return;
+  }
+  pthread_mutex_lock(&spillMutex);
+  if (!spillFile) {
+    spillFile.reset(new SpillFile(spillPath, categoryHandled + ".spill"));
+    unsigned long long left = spillFile->recover();
+    if (left > 0) {
+      LOG_OPER("[%s] reading back <%llu> bytes from spill file <%s>",
+               categoryHandled.c_str(), left,
+               spillFile->getFilename().c_str());
+      spilling = true;
+      signalWork();
+    }
+  }
+  pthread_mutex_unlock(&spillMutex);
+}
+
+void StoreQueue::getRecoverableCategories(set<string>& categories) {
+  // directories and the suffix of the files to look for in them
+  vector<pair<string, string> > patterns;
+  if (!journalPath.empty()) {
+    patterns.push_back(make_pair(journalPath, string(".journal.0")));
+    patterns.push_back(make_pair(journalPath, string(".journal.1")));
+  }
+  if (!spillPath.empty()) {
+    patterns.push_back(make_pair(spillPath, string(".spill")));
+  }
+
+  for (vector<pair<string, string> >::iterator pattern = patterns.begin();
+       pattern != patterns.end();
+       ++pattern) {
+    const string& dir = pattern->first;
+    const string& suffix = pattern->second;
+    vector<string> files = FileInterface::list(dir, "std");
+    for (vector<string>::iterator file = files.begin();
+         file != files.end();
+         ++file) {
+      if (file->size() <= suffix.size() ||
+          file->compare(file->size() - suffix.size(), suffix.size(),
+                        suffix) != 0) {
+        continue;
+      }
+      // free journal segments are truncated
+      if (FileInterface::createFileInterface("std", dir + "/" + *file)
+            ->fileSize() > 0) {
+        categories.insert(file->substr(0, file->size() - suffix.size()));
+      }
+    }
+  }
+}
+
+// Opens journal if journal_path is set, and queues whatever a previous run
+// left in it ahead of anything Log() adds. It is queued as a single batch,
+// so that the store thread can't take part of it and release the journal
+// before the rest is queued.
+void StoreQueue::openJournal() {
+  if (journalPath.empty() || journal) {
+    return;
+  }
+  journal.reset(new Journal(journalPath, categoryHandled + ".journal"));
+  logentry_vector_t messages;
+  if (!journal->open(messages)) {
+    LOG_OPER("[%s] not journaling, failed to open journal in <%s>",
+             categoryHandled.c_str(), journalPath.c_str());
+    journal.reset();
+    return;
+  }
+
+  if (!messages.empty()) {
+    msg_batch_t* batch = new msg_batch_t;
+    batch->first = messages.front();
+    batch->rest.assign(messages.begin() + 1, messages.end());
+    batch->size = 0;
+    for (logentry_vector_t::const_iterator iter = messages.begin();
+         iter != messages.end();
+         ++iter) {
+      batch->size += (*iter)->message.size();
+    }
+    pushBatch(batch, true);
+    signalWork();
   }
 }
 
 void StoreQueue::configureInline(pStoreConf configuration) {
   // Constructor defaults are fine if these don't exist
   configuration->getUnsignedLongLong("target_write_size", targetWriteSize);
-  configuration->getUnsigned("max_write_interval",
-                            (unsigned long&) maxWriteInterval);
-  if (maxWriteInterval == 0) {
+  // max_write_interval is in seconds, max_write_interval_ms overrides it
+  unsigned long max_write_interval;
+  if (configuration->getUnsigned("max_write_interval", max_write_interval)) {
+    maxWriteInterval = (max_write_interval ? max_write_interval : 1) * 1000;
+  }
+  if (configuration->getUnsigned("max_write_interval_ms", maxWriteInterval) &&
+      maxWriteInterval == 0) {
     maxWriteInterval = 1;
   }
 
   string tmp;
+  if (configuration->getString("adaptive_write_size", tmp)) {
+    adaptiveWriteSize = (tmp == "yes");
+  }
+  configuration->getUnsignedLongLong("adaptive_min_write_size", minWriteSize);
+  configuration->getUnsignedLongLong("adaptive_max_write_size", maxWriteSize);
+  configuration->getUnsigned("target_write_latency_ms", targetWriteLatency);
+  if (minWriteSize == 0) {
+    minWriteSize = 1;
+  }
+  if (maxWriteSize < minWriteSize) {
+    maxWriteSize = minWriteSize;
+  }
+  if (adaptiveWriteSize) {
+    targetWriteSize = min(max(targetWriteSize, minWriteSize), maxWriteSize);
+  }
+  if (!isModel) {
+    reportWriteSize();
+  }
+
+  configuration->getUnsigned("min_retry_backoff_ms", minRetryBackoff);
+  configuration->getUnsigned("max_retry_backoff_ms", maxRetryBackoff);
+  if (minRetryBackoff == 0) {
+    minRetryBackoff = 1;
+  }
+  if (maxRetryBackoff < minRetryBackoff) {
+    maxRetryBackoff = minRetryBackoff;
+  }
+
   if (configuration->getString("must_succeed", tmp) && tmp == "no") {
     mustSucceed = false;
   }
@@ -25,8 +25,23 @@
 #define SCRIBE_STORE_QUEUE_H
 
 #include "common.h"
+#include "rate_limiter.h"
+#include "spill_file.h"
+#include "journal.h"
+#include "memory_budget.h"
 
 class Store;
+class CounterHandle;
+class LatencyHistogram;
+class StoreExecutor;
+
+// Configured by priority=low|normal|high in a store's config
+enum store_priority_t {
+  PRIORITY_LOW,
+  PRIORITY_NORMAL,
+  PRIORITY_HIGH,
+  NUM_PRIORITIES
+};
 
 /*
  * This class implements a queue and a thread for dispatching
@@ -36,12 +51,14 @@ class Store;
 class StoreQueue {
  public:
   StoreQueue(const std::string& type, const std::string& category,
-             unsigned check_period, bool is_model=false, bool multi_category=false);
+             unsigned long check_period_ms, bool is_model=false,
+             bool multi_category=false);
   StoreQueue(const boost::shared_ptr<StoreQueue> example,
              const std::string &category);
   virtual ~StoreQueue();
 
   void addMessage(logentry_ptr_t entry);
+  void addMessages(const logentry_vector_t& entries); // queued as one batch
   void configureAndOpen(pStoreConf configuration); // closes first if already open
   void open();                                     // closes first if already open
   void stop();
@@ -55,16 +72,83 @@ class StoreQueue {
   // but no one else should ever call it.
   void threadMember();
 
+  // Used by StoreExecutor when there is no thread per StoreQueue.
+  // schedule() submits the queue unless it is already queued or running,
+  // runTask() does the work of one pass of threadMember().
+  void schedule();
+  void runTask();
+
   // WARNING: don't expect this to be exact, because it could change after you check.
   //          This is only for hueristics to decide when we're overloaded.
   inline unsigned long long getSize() {
     return msgQueueSize;
   }
+
+  // Log() takes a token per message from every StoreQueue a message is
+  // routed to. Configured by max_msg_per_second and max_msg_burst.
+  inline TokenBucket& getRateLimit() {
+    return rateLimit;
+  }
+
+  inline store_priority_t getPriority() const {
+    return priority;
+  }
+  // msgQueueSize is over max_queue_size times weight
+  inline bool isOverloaded() const {
+    return overloaded;
+  }
+
+  // Whether bytes more of messages fit in this queue's share of
+  // max_total_queue_size. Always true for batches that will be spilled.
+  bool admit(unsigned long long bytes);
+
+  // Adds the categories that have a journal or spill file left to read
+  // back in this queue's directories. For model stores.
+  void getRecoverableCategories(std::set<std::string>& categories);
+
+  // Bytes of messages this queue and its stores hold in memory
+  inline MemoryAccount& getMemoryAccount() {
+    return memoryAccount;
+  }
  private:
   void storeInitCommon();
   void configureInline(pStoreConf configuration);
   void openInline();
-  void processFailedMessages(boost::shared_ptr<logentry_vector_t> messages);
+  void openSpill();
+  void openJournal();
+  void processFailedMessages(boost::shared_ptr<logentry_vector_t> messages,
+                             batch_times_t& batch_times,
+                             unsigned long long size);
+  void updateOverloaded();
+  void leaveHandler();
+  void adaptWriteSize(bool handled, unsigned long long size,
+                      unsigned long msec);
+  void reportWriteSize();
+  void applyThreadPriority();
+
+  // A run of messages added by one addMessage(s) call. Log() threads push
+  // batches onto msgBatches with a CAS, and the store thread takes the
+  // whole list at once and reverses it, so producers never take a lock.
+  // Most Log() calls carry a single message for a category, so the first
+  // entry is kept inline to save allocating a vector for it.
+  struct msg_batch_t {
+    logentry_ptr_t first;
+    logentry_vector_t rest;
+    unsigned long long size; // in bytes
+    unsigned long enqueueTime; // from scribe::clock::monotonicInMsec()
+    msg_batch_t* next;
+  };
+
+  void pushBatch(msg_batch_t* batch, bool journaled = false);
+  void holdBatches();
+  void takeMessages(logentry_vector_t& messages, batch_times_t& batch_times,
+                    unsigned long long& size, unsigned long long max_size);
+  void signalWork();
+  void waitForWork(unsigned long wake_at);
+  bool spillBatch(msg_batch_t* batch);
+  boost::shared_ptr<logentry_vector_t> readSpill(batch_times_t& batch_times,
+                                                 unsigned long long& size);
+  bool runOnce(unsigned long& wake_at);
 
   // implementation of queues and thread
   enum store_command_t {
@@ -88,20 +172,77 @@ class StoreQueue {
   // handling of messages. This means that order of commands with
   // respect to messages is not preserved.
   cmd_queue_t cmdQueue;
-  boost::shared_ptr<logentry_vector_t> msgQueue;
-  boost::shared_ptr<logentry_vector_t> failedMessages;
-  unsigned long long msgQueueSize;   // in bytes
+  msg_batch_t* volatile msgBatches;  // newest first
+  msg_batch_t* heldBatches;          // taken off msgBatches but not handled
+  msg_batch_t* heldBatchesTail;      // yet, oldest first. Store thread only
+  boost::shared_ptr<logentry_vector_t> failedMessages; // store thread only
+  batch_times_t failedBatchTimes;
+  unsigned long long failedSize;     // bytes in failedMessages
+
+  // failedMessages is retried at retryAt, after a backoff that doubles
+  // with every failure. 0 while nothing failed. Producers don't wake the
+  // store thread while it is backing off.
+  volatile unsigned long retryAt;
+  unsigned long retryBackoff;      // in msec, store thread only
+  unsigned int retrySeed;          // for rand_r()
+
+  volatile unsigned long long msgQueueSize; // bytes in msg and heldBatches
+  volatile bool overloaded;          // msgQueueSize is over max_queue_size
+
+  // Everything from msgBatches until it is handled or lost, including
+  // failedMessages and batches read back from spillFile
+  MemoryAccount memoryAccount;
   pthread_t storeThread;
 
   // Mutexes
-  pthread_mutex_t cmdMutex;     // Must be held to read/modify cmdQueue
-  pthread_mutex_t msgMutex;     // Must be held to read/modify msgQueue
-  pthread_mutex_t hasWorkMutex; // Must be held to read/modify hasWork
-  // If acquiring multiple mutexes, always acquire in this order:
-  // {cmdMutex, msgMutex, hasWorkMutex}
+  pthread_mutex_t cmdMutex;      // Must be held to read/modify cmdQueue
+  pthread_mutex_t overloadMutex; // Held while overloaded changes
+  pthread_mutex_t spillMutex;    // Must be held to use spillFile or set spilling
+
+  // Once msgQueueSize is over spillQueueSize, batches are appended to
+  // spillFile instead, and keep going there until the store thread has
+  // read it all back, so that messages stay in order. NULL unless
+  // spill_path is configured.
+  boost::shared_ptr<SpillFile> spillFile;
+  volatile bool spilling;
 
-  bool hasWork;  // whether there are messages or commands queued
-  pthread_cond_t hasWorkCond; // cond variable to wait on for hasWork
+  // Every batch pushed onto msgBatches is appended to journal, which is
+  // sealed before batches are taken and released once the batches queued
+  // before the seal are handled, so it holds whatever is in memory. NULL
+  // unless journal_path is configured.
+  boost::shared_ptr<Journal> journal;
+  unsigned long lastJournalSync; // in msec, store thread only
+  // Batches moved to heldBatches and taken from it so far, and how many
+  // had been moved when the journal was last sealed. Store thread only.
+  unsigned long long batchesHeld;
+  unsigned long long batchesTaken;
+  unsigned long long batchesSealed;
+
+  // Set to 1 by whoever wakes the store thread, so that it is woken
+  // only once however many producers cross targetWriteSize. The store
+  // thread waits on the eventfd and clears hasWork when it wakes up.
+  volatile int hasWork;
+  int wakeupFd;
+
+  // With num_store_threads the queue runs on executor instead of
+  // storeThread. runState makes sure it is only queued or run once at a
+  // time, and stop() waits on stoppedSem instead of joining the thread.
+  enum run_state_t {
+    RUN_IDLE,
+    RUN_QUEUED,
+    RUN_RUNNING,
+    RUN_RERUN,    // woken again while running
+    RUN_STOPPED
+  };
+  StoreExecutor* executor;
+  volatile int runState;
+  sem_t stoppedSem;
+
+  // only used by whichever thread is running the queue, in msec from
+  // scribe::clock::monotonicInMsec()
+  unsigned long lastPeriodicCheck;
+  unsigned long lastHandleMessages;
+  bool storeOpened;
 
   bool stopping;
   bool isModel;
@@ -109,10 +250,47 @@ class StoreQueue {
 
   // configuration
   std::string        categoryHandled;  // what category this store is handling
-  time_t             checkPeriod;      // how often to call periodicCheck in seconds
-  unsigned long long targetWriteSize;  // in bytes
-  time_t             maxWriteInterval; // in seconds
+  unsigned long      checkPeriod;      // how often to call periodicCheck in msec
+  unsigned long long targetWriteSize;  // in bytes, tuned if adaptiveWriteSize
+  unsigned long      maxWriteInterval; // in msec
   bool               mustSucceed;      // Always retry even if secondary fails
+  unsigned long      minRetryBackoff;  // in msec
+  unsigned long      maxRetryBackoff;  // in msec
+
+  // With adaptive_write_size, targetWriteSize grows by minWriteSize after
+  // every full write that took at most targetWriteLatency, and is halved
+  // after one that took longer or failed, staying within
+  // [minWriteSize, maxWriteSize]. Writes are capped at targetWriteSize.
+  bool               adaptiveWriteSize;
+  unsigned long long minWriteSize;     // in bytes
+  unsigned long long maxWriteSize;     // in bytes
+  unsigned long      targetWriteLatency; // in msec
+  long long          reportedWriteSize;  // added to writeSizeCounter so far
+  TokenBucket        rateLimit;        // messages per second for this queue
+  store_priority_t   priority;
+  unsigned long      weight;           // multiplies max_queue_size and, with
+                                       // num_store_threads, the bytes
+                                       // written per pass
+  std::string        spillPath;        // directory for spillFile
+  unsigned long long spillQueueSize;   // in bytes
+  unsigned long long maxSpillSize;     // in bytes, 0 for no limit
+  std::string        journalPath;      // directory for journal
+  unsigned long      journalSyncInterval; // in msec, 0 to never sync
+  unsigned long long reservedQueueSize; // of max_total_queue_size, in bytes
+
+  CounterHandle* requeueCounter;
+  CounterHandle* lostCounter;
+  CounterHandle* spillCounter;
+  CounterHandle* retryCounter;
+  CounterHandle* retryBackoffCounter; // msec spent backing off
+  CounterHandle* writeSizeCounter; // targetWriteSize, kept by adding changes
+  // Per stage histograms. Everything in them is atomic, so the store
+  // thread never takes a lock to record.
+  LatencyHistogram* flushLatency; // from addMessages() to store->flush()
+  LatencyHistogram* queueWait;    // from addMessages() until taken
+  LatencyHistogram* batchSize;    // messages per handleMessages()
+  LatencyHistogram* handleTime;   // of handleMessages()
+  LatencyHistogram* flushTime;    // of flush()
 
   // Store that will handle messages. This can contain other stores.
   boost::shared_ptr<Store> store;
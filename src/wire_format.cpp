@@ -0,0 +1,320 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#include "common.h"
+#include "wire_format.h"
+
+#include <zlib.h>
+#ifdef USE_SCRIBE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_SCRIBE_ZSTD
+#include <zstd.h>
+#endif
+
+using std::string;
+using boost::shared_ptr;
+using namespace apache::thrift;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::transport;
+
+#define FRAME_HEADER_SIZE 5
+
+// first byte of a message written by TCompactProtocol
+#define COMPACT_PROTOCOL_ID 0x82
+
+static const char* codecName(frame_codec_t codec) {
+  switch (codec) {
+  case CODEC_ZLIB:
+    return "zlib";
+  case CODEC_LZ4:
+    return "lz4";
+  case CODEC_ZSTD:
+    return "zstd";
+  default:
+    return "none";
+  }
+}
+
+static bool isCodecAvailable(frame_codec_t codec) {
+  switch (codec) {
+  case CODEC_NONE:
+  case CODEC_ZLIB:
+    return true;
+#ifdef USE_SCRIBE_LZ4
+  case CODEC_LZ4:
+    return true;
+#endif
+#ifdef USE_SCRIBE_ZSTD
+  case CODEC_ZSTD:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+string wire_format_t::toString() const {
+  string result(compact ? "compact" : "binary");
+  if (codec != CODEC_NONE) {
+    result += "+";
+    result += codecName(codec);
+  }
+  return result;
+}
+
+bool wire_format_t::configure(pStoreConf configuration) {
+  bool success = true;
+  string protocol;
+  if (configuration->getString("protocol", protocol)) {
+    if (protocol == "compact") {
+      compact = true;
+    } else if (protocol == "binary") {
+      compact = false;
+    } else {
+      LOG_OPER("invalid protocol <%s>, using binary", protocol.c_str());
+      compact = false;
+      success = false;
+    }
+  }
+
+  string compression;
+  if (configuration->getString("compression", compression) &&
+      !parseCodec(compression, codec)) {
+    success = false;
+  }
+  return success;
+}
+
+bool parseCodec(const string& name, frame_codec_t& codec) {
+  codec = CODEC_NONE;
+  for (int i = CODEC_ZLIB; i <= CODEC_ZSTD; ++i) {
+    if (name == codecName((frame_codec_t)i)) {
+      codec = (frame_codec_t)i;
+    }
+  }
+  // frames are zlib streams, but gzip is what people tend to ask for
+  if (name == "gzip") {
+    codec = CODEC_ZLIB;
+  }
+  if (codec == CODEC_NONE && name != "none") {
+    LOG_OPER("invalid compression <%s>, not compressing", name.c_str());
+    return false;
+  } else if (!isCodecAvailable(codec)) {
+    LOG_OPER("compression <%s> is not compiled in, not compressing",
+             name.c_str());
+    codec = CODEC_NONE;
+    return false;
+  }
+  return true;
+}
+
+bool compressFrame(frame_codec_t codec, const uint8_t* data, uint32_t size,
+                   string& _return) {
+  size_t bound;
+  switch (codec) {
+  case CODEC_ZLIB:
+    bound = compressBound(size);
+    break;
+#ifdef USE_SCRIBE_LZ4
+  case CODEC_LZ4:
+    bound = LZ4_compressBound(size);
+    break;
+#endif
+#ifdef USE_SCRIBE_ZSTD
+  case CODEC_ZSTD:
+    bound = ZSTD_compressBound(size);
+    break;
+#endif
+  default:
+    return false;
+  }
+
+  _return.resize(FRAME_HEADER_SIZE + bound);
+  char* header = &_return[0];
+  header[0] = (char)codec;
+  header[1] = (char)(size >> 24);
+  header[2] = (char)(size >> 16);
+  header[3] = (char)(size >> 8);
+  header[4] = (char)size;
+  char* out = header + FRAME_HEADER_SIZE;
+
+  size_t compressed = 0;
+  switch (codec) {
+  case CODEC_ZLIB: {
+    // favour speed, these frames are usually sent within a datacenter
+    uLongf len = bound;
+    if (compress2((Bytef*)out, &len, data, size, Z_BEST_SPEED) != Z_OK) {
+      return false;
+    }
+    compressed = len;
+    break;
+  }
+#ifdef USE_SCRIBE_LZ4
+  case CODEC_LZ4: {
+    int len = LZ4_compress_default((const char*)data, out, size, bound);
+    if (len <= 0) {
+      return false;
+    }
+    compressed = len;
+    break;
+  }
+#endif
+#ifdef USE_SCRIBE_ZSTD
+  case CODEC_ZSTD: {
+    size_t len = ZSTD_compress(out, bound, data, size, 1);
+    if (ZSTD_isError(len)) {
+      return false;
+    }
+    compressed = len;
+    break;
+  }
+#endif
+  default:
+    return false;
+  }
+  _return.resize(FRAME_HEADER_SIZE + compressed);
+  return true;
+}
+
+bool compressedFrameLength(const uint8_t* data, uint32_t size,
+                           uint32_t& length) {
+  if (size < FRAME_HEADER_SIZE || !isCompressedFrame(data[0])) {
+    return false;
+  }
+  length = ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16) |
+           ((uint32_t)data[3] << 8) | (uint32_t)data[4];
+  return true;
+}
+
+bool decompressFrame(const uint8_t* data, uint32_t size, string& _return) {
+  uint32_t length;
+  if (!compressedFrameLength(data, size, length)) {
+    return false;
+  }
+  frame_codec_t codec = (frame_codec_t)data[0];
+  if (length > MAX_UNCOMPRESSED_FRAME) {
+    return false;
+  }
+  const uint8_t* in = data + FRAME_HEADER_SIZE;
+  uint32_t in_size = size - FRAME_HEADER_SIZE;
+
+  _return.resize(length);
+  if (length == 0) {
+    return true;
+  }
+  char* out = &_return[0];
+  switch (codec) {
+  case CODEC_ZLIB: {
+    uLongf len = length;
+    return uncompress((Bytef*)out, &len, in, in_size) == Z_OK &&
+           len == length;
+  }
+#ifdef USE_SCRIBE_LZ4
+  case CODEC_LZ4:
+    return LZ4_decompress_safe((const char*)in, out, in_size, length) ==
+           (int)length;
+#endif
+#ifdef USE_SCRIBE_ZSTD
+  case CODEC_ZSTD: {
+    size_t len = ZSTD_decompress(out, length, in, in_size);
+    return !ZSTD_isError(len) && len == length;
+  }
+#endif
+  default:
+    return false;
+  }
+}
+
+
+WireFormatProcessor::WireFormatProcessor(shared_ptr<TProcessor> processor_)
+  : processor(processor_) {
+}
+
+bool WireFormatProcessor::process(shared_ptr<TProtocol> in,
+                                  shared_ptr<TProtocol> out,
+                                  void* connectionContext) {
+  // TNonblockingServer hands us the whole frame in a memory buffer
+  shared_ptr<TMemoryBuffer> input =
+    boost::dynamic_pointer_cast<TMemoryBuffer>(in->getTransport());
+  uint8_t* data = NULL;
+  uint32_t size = 0;
+  if (input) {
+    input->getBuffer(&data, &size);
+  }
+  if (size == 0) {
+    return processor->process(in, out, connectionContext);
+  }
+
+  if (data[0] == COMPACT_PROTOCOL_ID) {
+    shared_ptr<TProtocol> compact_in(new TCompactProtocol(in->getTransport()));
+    shared_ptr<TProtocol> compact_out(
+      new TCompactProtocol(out->getTransport()));
+    return processor->process(compact_in, compact_out, connectionContext);
+  }
+
+  if (!isCompressedFrame(data[0])) {
+    return processor->process(in, out, connectionContext);
+  }
+
+  frame_codec_t codec = (frame_codec_t)data[0];
+  string request;
+  if (!decompressFrame(data, size, request)) {
+    LOG_OPER("dropping connection with corrupt or unsupported <%s> frame",
+             codecName(codec));
+    return false;
+  }
+  input->consume(size);
+
+  shared_ptr<TMemoryBuffer> request_buffer(
+    new TMemoryBuffer((uint8_t*)request.data(), request.size(),
+                      TMemoryBuffer::OBSERVE));
+  shared_ptr<TMemoryBuffer> response_buffer(new TMemoryBuffer());
+  shared_ptr<TProtocol> request_protocol;
+  shared_ptr<TProtocol> response_protocol;
+  if (!request.empty() && (uint8_t)request[0] == COMPACT_PROTOCOL_ID) {
+    request_protocol.reset(new TCompactProtocol(request_buffer));
+    response_protocol.reset(new TCompactProtocol(response_buffer));
+  } else {
+    shared_ptr<TBinaryProtocol> binary_in(new TBinaryProtocol(request_buffer));
+    shared_ptr<TBinaryProtocol> binary_out(
+      new TBinaryProtocol(response_buffer));
+    binary_in->setStrict(false, false);
+    binary_out->setStrict(false, false);
+    request_protocol = binary_in;
+    response_protocol = binary_out;
+  }
+
+  bool result = processor->process(request_protocol, response_protocol,
+                                   connectionContext);
+
+  // oneway calls have no reply
+  uint8_t* reply;
+  uint32_t reply_size;
+  response_buffer->getBuffer(&reply, &reply_size);
+  if (reply_size > 0) {
+    string compressed;
+    if (!compressFrame(codec, reply, reply_size, compressed)) {
+      LOG_OPER("failed to compress <%s> reply", codecName(codec));
+      return false;
+    }
+    out->getTransport()->write((const uint8_t*)compressed.data(),
+                               compressed.size());
+  }
+  return result;
+}
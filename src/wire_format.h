@@ -0,0 +1,100 @@
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+//
+
+#ifndef SCRIBE_WIRE_FORMAT_H
+#define SCRIBE_WIRE_FORMAT_H
+
+#include "common.h"
+#include "conf.h"
+
+/*
+ * Optional Thrift wire formats for relaying between scribe servers.
+ *
+ * A compressed frame is a normal Thrift frame whose payload is
+ *   <codec byte> <uncompressed length, 4 bytes big endian> <compressed data>
+ * The codec byte can't be the first byte of a binary (0x00 or 0x80) or
+ * compact (0x82) message, so servers tell the formats apart for every
+ * frame and answer in the format they were asked in. Old clients keep
+ * working while servers are upgraded, and clients can switch over once
+ * their servers understand the new formats.
+ */
+enum frame_codec_t {
+  CODEC_NONE = 0,
+  CODEC_ZLIB = 1,
+  CODEC_LZ4  = 2,  // needs --enable-lz4 (USE_SCRIBE_LZ4)
+  CODEC_ZSTD = 3   // needs --enable-zstd (USE_SCRIBE_ZSTD)
+};
+
+// largest uncompressed frame we'll accept
+#define MAX_UNCOMPRESSED_FRAME (256 * 1024 * 1024)
+
+// Protocol and compression used by a scribeConn
+struct wire_format_t {
+  bool compact;        // TCompactProtocol instead of TBinaryProtocol
+  frame_codec_t codec;
+
+  wire_format_t() : compact(false), codec(CODEC_NONE) {}
+
+  bool isDefault() const {
+    return !compact && codec == CODEC_NONE;
+  }
+  std::string toString() const;
+
+  // Reads "protocol" (binary, compact) and "compression" (none, zlib,
+  // lz4, zstd). Returns false and leaves the default if they are invalid.
+  bool configure(pStoreConf configuration);
+};
+
+// Sets codec from its name in a "compression" option (none, zlib or its
+// alias gzip, lz4, zstd). Logs and returns false if the name is invalid or
+// the codec is not compiled in.
+bool parseCodec(const std::string& name, frame_codec_t& codec);
+
+// Returns false if codec is not compiled in
+bool compressFrame(frame_codec_t codec, const uint8_t* data, uint32_t size,
+                   std::string& _return);
+// Returns false if the frame is corrupt or uses an unknown codec
+bool decompressFrame(const uint8_t* data, uint32_t size, std::string& _return);
+// Sets length to what the frame holds uncompressed, without decompressing
+// it. Returns false if it isn't a compressed frame.
+bool compressedFrameLength(const uint8_t* data, uint32_t size,
+                           uint32_t& length);
+
+inline bool isCompressedFrame(uint8_t first_byte) {
+  return first_byte >= CODEC_ZLIB && first_byte <= CODEC_ZSTD;
+}
+
+/*
+ * Wraps the scribe processor on the server side. Frames that are compact
+ * or compressed are unpacked and answered in kind, anything else is
+ * passed through to the binary protocol as before.
+ */
+class WireFormatProcessor : public apache::thrift::TProcessor {
+ public:
+  explicit WireFormatProcessor(
+    boost::shared_ptr<apache::thrift::TProcessor> processor);
+
+  bool process(boost::shared_ptr<apache::thrift::protocol::TProtocol> in,
+               boost::shared_ptr<apache::thrift::protocol::TProtocol> out,
+               void* connectionContext);
+
+ private:
+  boost::shared_ptr<apache::thrift::TProcessor> processor;
+};
+
+#endif // SCRIBE_WIRE_FORMAT_H
@@ -0,0 +1,92 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+include_once 'tests.php';
+include_once 'testutil.php';
+
+// The primary store can't create its directory, so messages are buffered
+// in zlib compressed posix files, which rotate every 50KB of messages.
+// Then the secondary store can't rotate either for a while, and the
+// messages logged meanwhile wait in memory. Once both are back, every
+// message has to be read back from the compressed files, in order.
+
+$success = true;
+
+system("touch /tmp/scribetest_/test", $error);
+if ($error) {
+  print("ERROR: unable to block /tmp/scribetest_/test\n");
+  return false;
+}
+
+$pid = scribe_start('buffercompresstest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.buffercompresstest');
+
+print("test writing 5k messages to the compressed secondary store\n");
+stress_test('test', 'client1', 5000, 5000, 20, 100, 1);
+sleep(2);
+
+system("mv /tmp/scribe_test_/test /tmp/scribe_test_/moved && " .
+       "touch /tmp/scribe_test_/test", $error);
+if ($error) {
+  print("ERROR: unable to block /tmp/scribe_test_/test\n");
+  return false;
+}
+
+print("test writing 2k messages while the secondary store is down\n");
+stress_test('test', 'client2', 2000, 2000, 20, 100, 1);
+sleep(5);
+
+system("rm /tmp/scribe_test_/test && " .
+       "mv /tmp/scribe_test_/moved /tmp/scribe_test_/test", $error);
+if ($error) {
+  print("ERROR: unable to restore /tmp/scribe_test_/test\n");
+  return false;
+}
+sleep(5);
+
+system("rm /tmp/scribetest_/test", $error);
+if ($error) {
+  print("ERROR: unable to unblock /tmp/scribetest_/test\n");
+  return false;
+}
+
+print("Waiting for buffers to flush...\n");
+sleep(30);
+
+$counters = get_counters($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT']);
+if (!empty($counters['test:lost']) || !empty($counters['test:bytes lost'])) {
+  print("ERROR: messages were lost\n");
+  $success = false;
+}
+
+if (!scribe_stop($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'], $pid)) {
+  print("ERROR: could not stop scribe\n");
+  return false;
+}
+
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client1');
+
+if ($results["count"] != 5000 || $results["out_of_order"] != 0) {
+  $success = false;
+}
+
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client2');
+
+if ($results["count"] != 2000 || $results["out_of_order"] != 0) {
+  $success = false;
+}
+
+return $success;
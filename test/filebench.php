@@ -0,0 +1,74 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+// Compares fs_type std, posix and uring file stores under load spread
+// over many categories, each with its own store thread writing its own
+// file. max_queue_size is small, so clients get TRY_LATER and retry as soon
+// as a store falls behind its disk, and the rate is what the stores
+// sustain. Run it on the disk to measure, with dir pointing there. Starts
+// its own scribed on port 1463, so don't run it on a machine that is
+// already running scribe. uring needs scribed built with --enable-uring,
+// otherwise it runs as posix.
+//
+// usage: php filebench.php [scribed dir] [scribe_ctrl dir] [dir] [clients]
+
+include_once 'tests.php';
+include_once 'testutil.php';
+
+$scribed_path = $argc > 1 ? $argv[1] : '../src';
+$scribe_ctrl_path = $argc > 2 ? $argv[2] : '../examples';
+$dir = $argc > 3 ? $argv[3] : '/tmp/scribetest_/filebench';
+$num_clients = $argc > 4 ? $argv[4] : 16;
+
+$fs_types = array('std', 'posix', 'uring');
+$message_sizes = array(100, 4000);
+$num_categories = 16;
+$port = 1463;
+
+system("mkdir -p /tmp/scribetest_");
+$config = '/tmp/scribetest_/scribe.conf.filebench';
+
+$results = array();
+foreach ($fs_types as $fs_type) {
+  foreach ($message_sizes as $avg_size) {
+    system("rm -rf $dir/$fs_type");
+    file_put_contents($config,
+                      str_replace(array('@FS_TYPE@', '@DIR@'),
+                                  array($fs_type, "$dir/$fs_type"),
+                                  file_get_contents('scribe.conf.filebench')));
+
+    $pid = scribe_start('filebench', $scribed_path, $port, $config);
+    if (!$pid) {
+      exit(1);
+    }
+    $results[$fs_type][$avg_size] =
+      log_throughput_test('filebench', $num_clients, 20000, 10, $avg_size,
+                          $num_categories);
+    scribe_stop($scribe_ctrl_path, $port, $pid);
+  }
+}
+system("rm -rf $dir");
+
+print "\nfs_type  msg size    msgs/sec\n";
+foreach ($results as $fs_type => $rates) {
+  foreach ($rates as $avg_size => $rate) {
+    printf("%-7s  %8d  %10d\n", $fs_type, $avg_size, $rate);
+  }
+}
+
+?>
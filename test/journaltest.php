@@ -0,0 +1,66 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+
+include_once 'tests.php';
+include_once 'testutil.php';
+
+// Messages wait in memory for an hour before they are written, so all
+// that is left of them when scribed is killed is the journal. The next
+// scribed has to replay it.
+
+$success = true;
+
+$pid = scribe_start('journaltest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.journaltest');
+
+print("test writing 10k messages, then killing scribe\n");
+stress_test('test', 'client1', 10000, 10000, 20, 100, 1);
+
+// let the journal be synced
+sleep(1);
+system("kill -9 $pid", $error);
+if ($error) {
+  print("ERROR: could not kill scribe\n");
+  return false;
+}
+sleep(1);
+
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client1');
+
+if ($results["count"] != 0) {
+  print("ERROR: messages were written before scribe was killed\n");
+  $success = false;
+}
+
+print("restarting scribe to replay the journal\n");
+$pid = scribe_start('journaltest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.journaltest');
+
+// stopping writes out whatever is queued
+if (!scribe_stop($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'], $pid)) {
+  print("ERROR: could not stop scribe\n");
+  return false;
+}
+sleep(5);
+
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client1');
+
+if ($results["count"] != 10000 || $results["out_of_order"] != 0) {
+  $success = false;
+}
+
+return $success;
@@ -0,0 +1,59 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+// Measures Log() throughput for different values of
+// num_thrift_server_threads. Starts its own scribed on port 1463 for every
+// thread count, so don't run it on a machine that is already running scribe.
+//
+// usage: php logbench.php [scribed dir] [scribe_ctrl dir] [clients]
+
+include_once 'tests.php';
+include_once 'testutil.php';
+
+$scribed_path = $argc > 1 ? $argv[1] : '../src';
+$scribe_ctrl_path = $argc > 2 ? $argv[2] : '../examples';
+$num_clients = $argc > 3 ? $argv[3] : 16;
+
+$thread_counts = array(1, 2, 4, 8, 16, 32);
+$port = 1463;
+
+system("mkdir -p /tmp/scribetest_");
+$template = file_get_contents('scribe.conf.logbench');
+$results = array();
+
+foreach ($thread_counts as $threads) {
+  $config = "/tmp/scribetest_/scribe.conf.logbench.$threads";
+  file_put_contents($config,
+                    $template . "\nnum_thrift_server_threads=$threads\n");
+
+  $pid = scribe_start("logbench.$threads", $scribed_path, $port, $config);
+  if (!$pid) {
+    exit(1);
+  }
+
+  $results[$threads] = log_throughput_test('logbench', $num_clients, 100000,
+                                           100, 100, 8);
+  scribe_stop($scribe_ctrl_path, $port, $pid);
+}
+
+print "\nthrift threads    msgs/sec\n";
+foreach ($results as $threads => $rate) {
+  printf("%14d  %10d\n", $threads, $rate);
+}
+
+?>
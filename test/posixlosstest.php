@@ -0,0 +1,96 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+include_once 'tests.php';
+include_once 'testutil.php';
+
+// The primary store can't create its directory, so messages are buffered
+// in a posix secondary file. A partial frame is then appended to it, as a
+// crash in the middle of a write would leave behind. When the buffer is
+// replayed, every message before it is sent and the 30 bytes after its
+// header are counted as lost.
+
+$success = true;
+
+system("touch /tmp/scribetest_/test", $error);
+if ($error) {
+  print("ERROR: unable to block /tmp/scribetest_/test\n");
+  return false;
+}
+
+$pid = scribe_start('posixlosstest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.posixlosstest');
+
+print("test writing 1k messages to the secondary store\n");
+stress_test('test', 'client1', 1000, 1000, 20, 100, 1);
+sleep(3);
+
+if (!scribe_stop($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'], $pid)) {
+  print("ERROR: could not stop scribe\n");
+  return false;
+}
+sleep(5);
+
+$files = glob('/tmp/scribe_test_/test/test_[0-9]*');
+if (empty($files)) {
+  print("ERROR: nothing was buffered\n");
+  return false;
+}
+// a frame header promising 100 bytes, followed by only 30
+file_put_contents(end($files), pack('V', 100) . str_repeat('x', 30),
+                  FILE_APPEND);
+
+system("rm /tmp/scribetest_/test", $error);
+if ($error) {
+  print("ERROR: unable to unblock /tmp/scribetest_/test\n");
+  return false;
+}
+
+print("restarting scribe to send the buffer\n");
+$pid = scribe_start('posixlosstest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.posixlosstest');
+
+// the buffer store of the category starts with its first message
+stress_test('test', 'client2', 10, 10, 1, 100, 1);
+
+print("Waiting for buffers to flush...\n");
+sleep(15);
+
+$counters = get_counters($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT']);
+if (!isset($counters['test:bytes lost']) ||
+    $counters['test:bytes lost'] != 30) {
+  print("ERROR: expected 30 bytes lost\n");
+  $success = false;
+}
+
+if (!scribe_stop($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'], $pid)) {
+  print("ERROR: could not stop scribe\n");
+  return false;
+}
+
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client1');
+
+if ($results["count"] != 1000 || $results["out_of_order"] != 0) {
+  $success = false;
+}
+
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client2');
+
+if ($results["count"] != 10 || $results["out_of_order"] != 0) {
+  $success = false;
+}
+
+return $success;
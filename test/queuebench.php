@@ -0,0 +1,59 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+// Measures how fast many Thrift threads can hand messages to a single
+// StoreQueue. All clients log to one category, so every call lands on the
+// same queue, at a few different batch sizes. Run it against two builds of
+// scribed to compare queue implementations. Starts its own scribed on port
+// 1463, so don't run it on a machine that is already running scribe.
+//
+// usage: php queuebench.php [scribed dir] [scribe_ctrl dir] [clients]
+
+include_once 'tests.php';
+include_once 'testutil.php';
+
+$scribed_path = $argc > 1 ? $argv[1] : '../src';
+$scribe_ctrl_path = $argc > 2 ? $argv[2] : '../examples';
+$num_clients = $argc > 3 ? $argv[3] : 32;
+
+$batch_sizes = array(1, 10, 100);
+$port = 1463;
+
+system("mkdir -p /tmp/scribetest_");
+$config = '/tmp/scribetest_/scribe.conf.queuebench';
+file_put_contents($config, file_get_contents('scribe.conf.queuebench') .
+                  "\nnum_thrift_server_threads=$num_clients\n");
+
+$pid = scribe_start('queuebench', $scribed_path, $port, $config);
+if (!$pid) {
+  exit(1);
+}
+
+$results = array();
+foreach ($batch_sizes as $msg_per_call) {
+  $results[$msg_per_call] = log_throughput_test('queuebench', $num_clients,
+                                                100000, $msg_per_call, 100, 1);
+}
+scribe_stop($scribe_ctrl_path, $port, $pid);
+
+print "\nmsgs per call    msgs/sec\n";
+foreach ($results as $msg_per_call => $rate) {
+  printf("%13d  %10d\n", $msg_per_call, $rate);
+}
+
+?>
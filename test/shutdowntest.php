@@ -0,0 +1,62 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+
+include_once 'tests.php';
+include_once 'testutil.php';
+
+// Stores write a small adaptive target_write_size per pass and sync it, so
+// a fast client leaves a backlog queued. Reinitializing and stopping scribe both
+// stop the store queues, which have to write that backlog out first.
+
+$success = true;
+
+$pid = scribe_start('shutdowntest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.shutdowntest');
+
+print("test writing 50k messages, then reinitializing\n");
+stress_test('test', 'client1', 100000, 50000, 50, 100, 1);
+
+if (!scribe_reload($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'])) {
+  print("ERROR: could not reinitialize scribe\n");
+  $success = false;
+}
+
+print("test writing another 50k messages, then stopping\n");
+stress_test('test', 'client2', 100000, 50000, 50, 100, 1);
+
+if (!scribe_stop($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'], $pid)) {
+  print("ERROR: could not stop scribe\n");
+  return false;
+}
+
+// give scribed time to write out its queues and exit
+sleep(5);
+
+// verify nothing queued got dropped
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client1');
+
+if ($results["count"] != 50000 || $results["out_of_order"] != 0) {
+  $success = false;
+}
+
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client2');
+
+if ($results["count"] != 50000 || $results["out_of_order"] != 0) {
+  $success = false;
+}
+
+return $success;
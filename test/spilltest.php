@@ -0,0 +1,64 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+include_once 'tests.php';
+include_once 'testutil.php';
+
+// Batches go to the spill file as soon as a few are queued, and the store
+// syncs every batch, so it is still reading the spill file back when
+// scribed stops. The next scribed has to carry on from where it stopped,
+// without writing anything twice.
+
+$success = true;
+
+$pid = scribe_start('spilltest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.spilltest');
+
+print("test writing 50k messages, then stopping scribe\n");
+stress_test('test', 'client1', 50000, 50000, 20, 100, 1);
+
+$counters = get_counters($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT']);
+if (!isset($counters['test:spilled']) || $counters['test:spilled'] == 0) {
+  print("ERROR: nothing was spilled\n");
+  $success = false;
+}
+
+if (!scribe_stop($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'], $pid)) {
+  print("ERROR: could not stop scribe\n");
+  return false;
+}
+sleep(5);
+
+print("restarting scribe to read back the rest of the spill file\n");
+$pid = scribe_start('spilltest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.spilltest');
+
+// give the store time to catch up
+sleep(20);
+
+if (!scribe_stop($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'], $pid)) {
+  print("ERROR: could not stop scribe\n");
+  return false;
+}
+sleep(5);
+
+$results = resultChecker('/tmp/scribetest_/test', 'test_', 'client1');
+
+if ($results["count"] != 50000 || $results["out_of_order"] != 0) {
+  $success = false;
+}
+
+return $success;
@@ -494,6 +494,56 @@ function scribe_Log_test($messages, $scribe_client) {
   }
 }
 
+/* Send $total messages per client as fast as possible from $num_clients
+ * forked clients, spread over $num_categories categories.
+ * Returns the aggregate number of messages per second accepted by scribe.
+ */
+function log_throughput_test($category, $num_clients, $total, $msg_per_call,
+                             $avg_size, $num_categories) {
+  $pids = array();
+  $random = generate_random($avg_size * 2);
+  $start = microtime(true);
+
+  for ($client = 0; $client < $num_clients; ++$client) {
+    $pid = pcntl_fork();
+
+    if ($pid == -1) {
+      print "Error: Could not fork\n";
+      return 0;
+    } else if ($pid == 0) {
+      // In child process
+      $scribe_client = create_scribe_client();
+      $messages = array();
+      for ($i = 0; $i < $total; ++$i) {
+        $entry = new LogEntry;
+        $entry->category = $category . ($i % $num_categories);
+        $entry->message = make_message("client$client", $avg_size, $i, $random);
+        $messages []= $entry;
+
+        if (count($messages) >= $msg_per_call || $i == $total - 1) {
+          // retry until scribe accepts the batch so every run sends $total
+          while (scribe_Log_test($messages, $scribe_client) !== ResultCode::OK) {
+            usleep(1000);
+          }
+          $messages = array();
+        }
+      }
+      Exit(0);
+    } else {
+      // In parent process
+      $pids[] = $pid;
+    }
+  }
+
+  // have parent wait for all children
+  foreach ($pids as $pid) {
+    pcntl_waitpid($pid, $status);
+  }
+
+  $elapsed = microtime(true) - $start;
+  return ($num_clients * $total) / $elapsed;
+}
+
 function super_stress_test($categories, $client_name, $rate, $total,
                            $msg_per_call, $avg_size, $category_multiplier) {
   $pids = array();
@@ -42,6 +42,11 @@ $ALL_TESTS = array(
   'basictest2',
   'buffertest',
   'buffertest2',
+  'shutdowntest',
+  'journaltest',
+  'spilltest',
+  'posixlosstest',
+  'buffercompresstest',
 //  'categoriestest',
   'bucketupdater',
   'paramtest',